@@ -18,9 +18,11 @@
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <execinfo.h>
 #include <getopt.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +30,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -35,23 +38,56 @@
 #include <array>
 #include <atomic>
 #include <csignal>
+#include <deque>
+#include <fstream>
 #include <chrono>
+#include <cmath>
+#include <iomanip>
 #include <iostream>
 #include <list>
+#include <memory>
+#include <map>
 #include <mutex>
+#include <queue>
+#include <random>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 #include <openssl/tls1.h>
 
 static const int DEFAULT_THREADS = 1;
 static const int DEFAULT_PEERS = 1;
 static const int PEERS_SLOW_START = 10;
 static const int LATENCY_N = 1024;
+// Minimal h/s gain (in percents) for a thread scaling step to be considered
+// as still client bound.
+static const int SWEEP_MIN_GAIN = 10;
+// Histogram of handshake latencies with 1ms buckets, the last bucket
+// accumulates all the larger latencies.
+static const int LAT_HIST_N = 1024;
+// Weight of new concurrency limit in the adaptive concurrency controller.
+static const double ADAPT_SMOOTH = 0.5;
+// Number of measures (seconds) in each line of adaptive concurrency history.
+static const int ADAPT_HIST_STEP = 10;
+// Delay before the first burst to let all the threads prepare their peers.
+static const int BURST_DELAY_MSEC = 500;
+// Default maximum number of sessions in the shared pool, older sessions are
+// evicted.
+static const size_t SESS_POOL_MAX = 65536;
+// Default time to wait for TLS 1.3 session tickets after a handshake.
+static const int TICKETS_WAIT_MSEC = 100;
+// Time to wait for the first byte of a response to the request.
+static const int RESPONSE_TO_MSEC = 1000;
+static const char *DEFAULT_REQUEST = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+// Magic of the sessions file: a sequence of 2-byte network order length and
+// DER encoded session records follows the magic.
+static const char SESS_FILE_MAGIC[8] = {'T', 'L', 'S', 'P', 'S', 'E', 'S', '1'};
 
 // Dump shared keys for Wireshark analysis
 static BIO *bio_keylog;
@@ -66,23 +102,195 @@ keylog(const SSL *tls, const char *line)
 	}
 }
 
+/**
+ * Random distribution of think and hold times in milliseconds.
+ */
+struct Dist {
+	enum {
+		NONE,
+		FIXED,
+		EXP,
+		LOGNORMAL,
+	}		type;
+	double		mean;
+	double		sigma;
+
+	bool parse(const char *str) noexcept;
+	unsigned long sample() noexcept;
+	void print() const noexcept;
+};
+
+/**
+ * Explicit session resumption modes, RESUME_ANY leaves the choice to OpenSSL.
+ */
+enum {
+	RESUME_ANY,
+	RESUME_ID,
+	RESUME_TICKET,
+	RESUME_PSK_DHE_KE,
+	RESUME_PSK_KE,
+};
+
+static const char *resume_modes[] = {
+	"any", "id", "ticket", "psk_dhe_ke", "psk_ke"
+};
+
+/**
+ * Handshakes which the server must reject or fall back to a full handshake.
+ */
+enum {
+	REJECT_NONE,
+	REJECT_VERSION,
+	REJECT_CIPHER,
+	REJECT_GROUP,
+	REJECT_SNI,
+	REJECT_TICKET,
+};
+
+static const char *reject_modes[] = {
+	"none", "version", "cipher", "group", "sni", "ticket"
+};
+
+static const char *REJECT_SNI_NAME = "reject.tls-perf.invalid";
+
 struct {
 	int			n_peers;
 	int			n_threads;
 	size_t			n_hs;
 	int			timeout;
+	int			lat_target;
+	int			burst_period;
+	Dist			think;
+	Dist			hold;
+	Dist			rekey;
 	uint16_t		port;
 	bool			debug;
 	bool			quiet;
+	bool			sweep;
+	bool			early_data;
+	bool			pha;
+	bool			ocsp;
+	bool			grease;
+	bool			psk_ke;
+	bool			padding;
 	int			tls_vers;
 	int			use_tickets;
 	int			adv_tickets;
+	int			resume;
+	int			resume_ratio;
+	int			reject;
+	int			tickets_wait;
+	int			tickets_to;
+	int			pha_to;
+	size_t			sess_pool_max;
+	const char		*sess_load;
+	const char		*sess_save;
 	const char		*cipher;
 	const char		*curve;
+	const char		*key_share;
+	const char		*cert_comp;
+	const char		*sigalgs;
+	int			max_frag;
+	int			record_limit;
+	const char		*alpn;
 	const char		*keylogfile;
+	const char		*scenario;
+	const char		*mix;
+	const char		*profile;
+	const char		*profiles;
+	const char		*client_certs;
+	const char		*psk;
+	const char		*sni_file;
+	int			sni_dist;
+	double			sni_zipf_s;
+	const char		*verify;
+	const char		*verify_host;
+	bool			client_cert_random;
+	std::string		request;
 	struct sockaddr_in6	ip;
 } g_opt;
 
+typedef decltype(g_opt) Opts;
+
+static thread_local std::mt19937 rng(std::random_device{}());
+
+/**
+ * Parse distribution specification in one of the forms:
+ *	<ms>, fixed:<ms>, exp:<mean ms> or lognormal:<mean ms>:<sigma>
+ */
+bool
+Dist::parse(const char *str) noexcept
+{
+	char *end;
+
+	sigma = 0;
+	if (!strncmp(str, "fixed:", 6)) {
+		type = FIXED;
+		str += 6;
+	} else if (!strncmp(str, "exp:", 4)) {
+		type = EXP;
+		str += 4;
+	} else if (!strncmp(str, "lognormal:", 10)) {
+		type = LOGNORMAL;
+		str += 10;
+	} else {
+		type = FIXED;
+	}
+
+	mean = strtod(str, &end);
+	if (end == str || mean < 0)
+		return false;
+	// Zero mean is a zero rate for exponential and log(0) for lognormal.
+	if (type != FIXED && mean == 0)
+		return false;
+	if (type == LOGNORMAL) {
+		if (*end != ':')
+			return false;
+		str = end + 1;
+		sigma = strtod(str, &end);
+		if (end == str || sigma <= 0)
+			return false;
+	}
+	return !*end;
+}
+
+unsigned long
+Dist::sample() noexcept
+{
+	switch (type) {
+	case FIXED:
+		return mean;
+	case EXP:
+		return std::exponential_distribution<>(1 / mean)(rng);
+	case LOGNORMAL:
+		// Choose mu so that the distribution mean is @mean.
+		return std::lognormal_distribution<>(std::log(mean)
+						      - sigma * sigma / 2,
+						      sigma)(rng);
+	default:
+		return 0;
+	}
+}
+
+void
+Dist::print() const noexcept
+{
+	switch (type) {
+	case FIXED:
+		std::cout << mean << "ms";
+		break;
+	case EXP:
+		std::cout << "exponential, mean " << mean << "ms";
+		break;
+	case LOGNORMAL:
+		std::cout << "lognormal, mean " << mean << "ms, sigma "
+			  << sigma;
+		break;
+	default:
+		std::cout << "none";
+	}
+}
+
 struct DbgStream {
 	template<typename T>
 	const DbgStream &
@@ -102,6 +310,19 @@ struct DbgStream {
 	}
 } dbg;
 
+/**
+ * User and system CPU time consumed by all the threads of the process.
+ */
+static uint64_t
+cpu_usage_us() noexcept
+{
+	struct rusage ru = {};
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000UL
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
 struct {
 	typedef std::chrono::time_point<std::chrono::steady_clock> __time_t;
 
@@ -111,7 +332,9 @@ struct {
 	std::atomic<int32_t>	tls_connections;
 	std::atomic<int32_t>	tls_handshakes;
 	std::atomic<int32_t>	error_count;
-	int32_t			__no_false_sharing[9];
+	std::atomic<int32_t>	tls_established;
+	std::atomic<int32_t>	tls_resumed;
+	int32_t			__no_false_sharing[7];
 
 	__time_t		stat_time;
 
@@ -121,18 +344,32 @@ struct {
 	int32_t			avg_hs;
 	std::vector<int32_t>	hs_history;
 
+	// Client CPU time, wall time and number of handshakes in the measured
+	// intervals.
+	uint64_t		cpu_prev;
+	uint64_t		cpu_us;
+	uint64_t		wall_us;
+	uint64_t		meas_hs;
+
 	void
 	start_count()
 	{
 		stat_time = std::chrono::steady_clock::now();
+		cpu_prev = cpu_usage_us();
 	}
 } stat __attribute__((aligned(L1DSZ))); // no split-locking
 
-static struct {
+// @finish stops the current benchmark run, while @interrupted stops the
+// whole program including all the remaining thread sweep steps.
+std::atomic<bool> finish(false), interrupted(false), start_stats(false);
+
+struct LatencyAcc {
 	std::mutex			lock;
 	std::vector<unsigned long>	stat;
 	unsigned long			acc_lat;
-} g_lat_stat;
+};
+
+static LatencyAcc g_lat_stat;
 
 class LatencyStat {
 public:
@@ -160,14 +397,14 @@ public:
 	}
 
 	void
-	dump() noexcept
+	dump(LatencyAcc &acc = g_lat_stat) noexcept
 	{
-		std::lock_guard<std::mutex> _(g_lat_stat.lock);
+		std::lock_guard<std::mutex> _(acc.lock);
 		for (auto l : stat_) {
 			if (!l)
 				break;
-			g_lat_stat.stat.push_back(l);
-			g_lat_stat.acc_lat += l;
+			acc.stat.push_back(l);
+			acc.acc_lat += l;
 		}
 	}
 
@@ -179,6 +416,365 @@ private:
 
 static thread_local LatencyStat lat_stat __attribute__((aligned(L1DSZ)));
 
+/**
+ * Handshake messages sizes, TLS records and TCP segments with data sent and
+ * received during a handshake.
+ */
+struct HsSizes {
+	size_t		ch;
+	size_t		sh;
+	size_t		srv;
+	size_t		recs_out;
+	size_t		recs_in;
+	size_t		segs_out;
+	size_t		segs_in;
+};
+
+/**
+ * Handshakes statistics broken down by a handshake property, e.g. full and
+ * resumed handshakes. A class is a value of the property in the group of
+ * classes for the property. Classes are registered on first use, so the set
+ * of classes needn't be known in advance.
+ */
+struct HsClass {
+	std::string		group;
+	std::string		name;
+	std::atomic<uint64_t>	hs;
+	LatencyAcc		lat;
+	// Handshake messages sizes, records and TCP segments, if accounted.
+	std::atomic<uint64_t>	sized;
+	std::atomic<uint64_t>	ch_bytes;
+	std::atomic<uint64_t>	sh_bytes;
+	std::atomic<uint64_t>	srv_bytes;
+	std::atomic<uint64_t>	recs_out;
+	std::atomic<uint64_t>	recs_in;
+	std::atomic<uint64_t>	segs_out;
+	std::atomic<uint64_t>	segs_in;
+
+	HsClass(const std::string &g, const std::string &n) noexcept
+		: group(g), name(n), hs(0), sized(0), ch_bytes(0), sh_bytes(0)
+		, srv_bytes(0), recs_out(0), recs_in(0), segs_out(0)
+		, segs_in(0)
+	{
+		lat.acc_lat = 0;
+	}
+};
+
+static struct {
+	std::mutex				lock;
+	std::list<std::unique_ptr<HsClass>>	cls;
+} g_hs_class;
+
+// Per-thread latencies for each handshake class.
+static thread_local std::map<HsClass *, std::unique_ptr<LatencyStat>>
+	hs_class_lat;
+
+static HsClass *
+hs_class(const std::string &group, const std::string &name)
+{
+	// Most of the lookups are for the same classes, so cache them
+	// in each thread to not contend on the lock.
+	static thread_local std::map<std::pair<std::string, std::string>,
+				     HsClass *> cache;
+	auto key = std::make_pair(group, name);
+	auto c = cache.find(key);
+	if (c != cache.end())
+		return c->second;
+
+	std::lock_guard<std::mutex> _(g_hs_class.lock);
+	HsClass *hc = NULL;
+	for (auto &cl : g_hs_class.cls)
+		if (cl->group == group && cl->name == name) {
+			hc = cl.get();
+			break;
+		}
+	if (!hc) {
+		g_hs_class.cls.emplace_back(new HsClass(group, name));
+		hc = g_hs_class.cls.back().get();
+	}
+	cache[key] = hc;
+	return hc;
+}
+
+/**
+ * Count a handshake without latency, e.g. for operations completing locally.
+ */
+static void
+hs_class_count(const std::string &group, const std::string &name)
+{
+	hs_class(group, name)->hs++;
+}
+
+static void
+hs_class_update(const std::string &group, const std::string &name,
+		unsigned long lat)
+{
+	auto hc = hs_class(group, name);
+	auto &l = hs_class_lat[hc];
+
+	hc->hs++;
+	if (!l)
+		l.reset(new LatencyStat());
+	l->update(lat);
+}
+
+static void
+hs_class_sizes(const std::string &group, const std::string &name,
+	       const HsSizes &s)
+{
+	auto hc = hs_class(group, name);
+
+	hc->sized++;
+	hc->ch_bytes += s.ch;
+	hc->sh_bytes += s.sh;
+	hc->srv_bytes += s.srv;
+	hc->recs_out += s.recs_out;
+	hc->recs_in += s.recs_in;
+	hc->segs_out += s.segs_out;
+	hc->segs_in += s.segs_in;
+}
+
+/**
+ * Move the latencies of the current thread to the global statistics.
+ */
+static void
+hs_class_dump_thread() noexcept
+{
+	for (auto &l : hs_class_lat)
+		l.second->dump(l.first->lat);
+	hs_class_lat.clear();
+}
+
+class LatencyHist;
+
+static struct {
+	std::mutex			lock;
+	std::list<LatencyHist *>	all;
+} g_lat_hist;
+
+/**
+ * Per-thread histogram of handshake latencies, which is collected and reset
+ * by the statistics thread each second, so it reflects the latencies of the
+ * last measurement interval only.
+ */
+class LatencyHist {
+public:
+	LatencyHist() noexcept
+	{
+		for (auto &b : b_)
+			b = 0;
+		std::lock_guard<std::mutex> _(g_lat_hist.lock);
+		g_lat_hist.all.push_back(this);
+	}
+
+	~LatencyHist() noexcept
+	{
+		std::lock_guard<std::mutex> _(g_lat_hist.lock);
+		g_lat_hist.all.remove(this);
+	}
+
+	void
+	update(unsigned long dt) noexcept
+	{
+		if (dt >= LAT_HIST_N)
+			dt = LAT_HIST_N - 1;
+		b_[dt].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	static unsigned long
+	collect_percentile(int p) noexcept
+	{
+		std::array<uint64_t, LAT_HIST_N> acc = {0};
+		uint64_t n = 0;
+
+		{
+			std::lock_guard<std::mutex> _(g_lat_hist.lock);
+			for (auto h : g_lat_hist.all)
+				for (int i = 0; i < LAT_HIST_N; ++i) {
+					auto v = h->b_[i].exchange(0,
+						std::memory_order_relaxed);
+					acc[i] += v;
+					n += v;
+				}
+		}
+		if (!n)
+			return 0;
+
+		uint64_t th = (n * p + 99) / 100, cnt = 0;
+		for (int i = 0; i < LAT_HIST_N; ++i) {
+			cnt += acc[i];
+			if (cnt >= th)
+				return i;
+		}
+		return LAT_HIST_N - 1;
+	}
+
+private:
+	std::array<std::atomic<uint32_t>, LAT_HIST_N>	b_;
+};
+
+static thread_local LatencyHist lat_hist;
+
+/**
+ * Adaptive concurrency controller: the number of parallel connections
+ * for each thread follows the 99th percentile of handshake latency.
+ */
+static struct {
+	struct Measure {
+		int		peers;
+		int32_t		hs;
+		unsigned long	p99;
+	};
+
+	std::atomic<int>	peers;
+	double			limit;
+	std::vector<Measure>	history;
+} g_adapt;
+
+/**
+ * Gradient controller similar to TCP Vegas: the limit shrinks proportionally
+ * to the ratio of the target and current latencies, but not more than twice
+ * per second, and grows by the square root of the limit, which plays the role
+ * of an allowed queue. The limit can also double each second while the
+ * latency is much lower than the target, just like on the slow start.
+ */
+static int
+adapt_concurrency(unsigned long p99) noexcept
+{
+	double lim = g_adapt.limit;
+	double grad = (double)g_opt.lat_target / std::max(p99, 1UL);
+
+	grad = std::max(0.5, std::min(2.0, grad));
+	lim = lim * (1 - ADAPT_SMOOTH)
+	      + (lim * grad + std::sqrt(lim)) * ADAPT_SMOOTH;
+	lim = std::max(1.0, std::min((double)g_opt.n_peers, lim));
+
+	g_adapt.limit = lim;
+	g_adapt.peers = (int)lim;
+
+	return g_adapt.peers;
+}
+
+/**
+ * TLS 1.3 session tickets received after the handshakes and the handshakes
+ * which got no ticket in time or were closed by the server before it.
+ */
+static struct {
+	std::atomic<uint64_t>	received;
+	std::atomic<uint64_t>	timeouts;
+	std::atomic<uint64_t>	closed;
+} g_tickets;
+
+static struct {
+	std::atomic<uint64_t>	sent;
+	std::atomic<uint64_t>	accepted;
+	std::atomic<uint64_t>	rejected;
+	std::atomic<uint64_t>	resp_errors;
+} g_early;
+
+static struct {
+	std::atomic<uint64_t>	timeouts;
+	std::atomic<uint64_t>	failed;
+} g_pha;
+
+static struct {
+	std::atomic<uint64_t>	timeouts;
+	std::atomic<uint64_t>	failed;
+	std::atomic<uint64_t>	refused;
+} g_rekey;
+
+static struct {
+	std::atomic<uint64_t>	bytes;
+	std::atomic<uint64_t>	raw_bytes;
+} g_cert_comp;
+
+static struct {
+	std::atomic<uint64_t>	stapled;
+	std::atomic<uint64_t>	bytes;
+	std::atomic<uint64_t>	max;
+} g_ocsp;
+
+/**
+ * Trust store for server certificates verification shared by all the TLS
+ * contexts, so CA certificates are loaded and parsed only once.
+ */
+static struct {
+	X509_STORE		*store;
+	std::atomic<uint64_t>	verified;
+	std::atomic<uint64_t>	failed;
+	std::atomic<uint64_t>	time_ns;
+} g_verify;
+
+/**
+ * Verify the server chain as OpenSSL does by default and account the time
+ * spent on the verification.
+ */
+static int
+verify_cb(X509_STORE_CTX *store_ctx, void *arg)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	int r = X509_verify_cert(store_ctx);
+	auto t1 = std::chrono::steady_clock::now();
+
+	g_verify.time_ns += std::chrono::duration_cast<
+				std::chrono::nanoseconds>(t1 - t0).count();
+	if (r > 0)
+		g_verify.verified++;
+	else
+		g_verify.failed++;
+	return r;
+}
+
+/**
+ * Synchronized bursts: all the threads release their parked peers at
+ * @start + N * period and report how the bursts drain.
+ */
+static struct {
+	struct Burst {
+		unsigned long			drain;
+		std::vector<unsigned long>	lat;
+		// Some thread was still draining the previous burst.
+		bool				missed;
+	};
+
+	std::chrono::time_point<std::chrono::steady_clock> start;
+	std::mutex			lock;
+	std::vector<Burst>		bursts;
+
+	void
+	update(size_t n, unsigned long drain,
+	       const std::vector<unsigned long> &lat) noexcept
+	{
+		std::lock_guard<std::mutex> _(lock);
+		if (bursts.size() <= n)
+			bursts.resize(n + 1);
+		auto &b = bursts[n];
+		b.drain = std::max(b.drain, drain);
+		b.lat.insert(b.lat.end(), lat.begin(), lat.end());
+	}
+
+	/**
+	 * All the threads skip the same bursts, so account them by index.
+	 */
+	void
+	miss(size_t n) noexcept
+	{
+		std::lock_guard<std::mutex> _(lock);
+		if (bursts.size() <= n)
+			bursts.resize(n + 1);
+		bursts[n].missed = true;
+	}
+} g_burst;
+
+/**
+ * Current limit of parallel connections for each thread.
+ */
+static inline int
+peers_limit() noexcept
+{
+	return g_opt.lat_target ? g_adapt.peers.load() : g_opt.n_peers;
+}
+
 class Except : public std::exception {
 private:
 	static const size_t maxmsg = 256;
@@ -221,117 +817,1448 @@ public:
 	}
 };
 
+/**
+ * Handshake details collected by the message callback for each connection.
+ */
+struct HsInfo {
+	enum {
+		PHA_NONE,
+		PHA_REQUESTED,
+		PHA_ANSWERED,
+	};
+
+	bool		hrr;
+	bool		cert_req;
+	bool		finished;
+	int		key_shares;
+	int		pha;
+	// The first ClientHello, ServerHello and all the server handshake
+	// messages before our Finished.
+	size_t		ch_len;
+	size_t		sh_len;
+	size_t		srv_len;
+	// TLS records sent and received during the handshake.
+	size_t		recs_out;
+	size_t		recs_in;
+	// Record size limit sent by the server.
+	int		rsl;
+	// Index of the SNI table entry or -1.
+	int		sni;
+	// Index of the connection class in the mix or -1.
+	int		mix;
+	// Certificate compression algorithm, compressed and uncompressed
+	// Certificate message sizes.
+	int		cert_comp;
+	size_t		cert_len;
+	size_t		cert_raw_len;
+	// The alert description received from the server or -1.
+	int		alert;
+	// Got KeyUpdate from the server after the handshake.
+	bool		key_update;
+	// ServerHello has a key share, i.e. not psk_ke.
+	bool		sh_key_share;
+	// Index of the external PSK or -1.
+	int		psk;
+
+	void
+	reset() noexcept
+	{
+		hrr = false;
+		cert_req = false;
+		finished = false;
+		key_shares = 0;
+		pha = PHA_NONE;
+		ch_len = sh_len = srv_len = 0;
+		recs_out = recs_in = 0;
+		rsl = 0;
+		sni = -1;
+		mix = -1;
+		cert_comp = 0;
+		cert_len = cert_raw_len = 0;
+		alert = -1;
+		key_update = false;
+		sh_key_share = false;
+		psk = -1;
+	}
+};
+
 struct SocketHandler {
 	virtual ~SocketHandler() {};
 	virtual bool next_state() =0;
 	virtual SSL_SESSION* get_session() = 0;
+	virtual void put_session(SSL_SESSION *sess) = 0;
 
 	int sd;
+	// Sequence number of the active timer, zero if there is no timer.
+	uint64_t timer;
+	HsInfo hs;
 };
 
-class IO {
-private:
-	static const size_t N_EVENTS = 128;
-	static const size_t TO_MSEC = 5;
-
-private:
-	int			ed_;
-	int			ev_count_;
-	SSL_CTX			*tls_ctx_;
-	struct epoll_event	events_[N_EVENTS];
-	std::list<SocketHandler *> reconnect_q_;
-	std::list<SocketHandler *> backlog_;
+/**
+ * Client certificates with their keys and chains, loaded at start, so
+ * a handshake only takes the references.
+ */
+struct ClientCert {
+	X509			*cert;
+	EVP_PKEY		*key;
+	STACK_OF(X509)		*chain;
+};
 
-public:
-	IO()
-		: ed_(-1), ev_count_(0), tls_ctx_(NULL)
-	{
-		tls_ctx_ = SSL_CTX_new(TLS_client_method());
+static struct {
+	std::vector<ClientCert>	certs;
+	std::atomic<uint64_t>	next;
+} g_client_certs;
 
-		// Allow only TLS 1.2 and 1.3, and chose only those user has
-		// requested.
-		if (g_opt.tls_vers != TLS_ANY_VERSION) {
-			SSL_CTX_set_min_proto_version(tls_ctx_, g_opt.tls_vers);
-			SSL_CTX_set_max_proto_version(tls_ctx_, g_opt.tls_vers);
-		} else {
-			SSL_CTX_set_min_proto_version(tls_ctx_, TLS1_2_VERSION);
-			SSL_CTX_set_max_proto_version(tls_ctx_, TLS1_3_VERSION);
-		}
+/**
+ * OpenSSL doesn't implement RFC 8449 record_size_limit, so send it as a
+ * custom extension. Our records are small anyway, so it's enough that the
+ * server limits its records.
+ */
+static const unsigned int TLSEXT_RECORD_SIZE_LIMIT = 28;
 
-		// Session resumption.
-		if (!g_opt.use_tickets) {
-			unsigned int mode = SSL_SESS_CACHE_OFF
-					  | SSL_SESS_CACHE_NO_INTERNAL;
-			if (!g_opt.adv_tickets)
-				SSL_CTX_set_options(tls_ctx_, SSL_OP_NO_TICKET);
-			SSL_CTX_set_session_cache_mode(tls_ctx_, mode);
-		}
-		else {
-			unsigned int mode = SSL_SESS_CACHE_CLIENT
-					  | SSL_SESS_CACHE_NO_AUTO_CLEAR;
-			SSL_CTX_set_session_cache_mode(tls_ctx_, mode);
-		}
-
-		if (g_opt.cipher) {
-			if (g_opt.tls_vers == TLS1_3_VERSION
-			    || g_opt.tls_vers == TLS_ANY_VERSION)
-				if (!SSL_CTX_set_ciphersuites(tls_ctx_,
-							      g_opt.cipher))
-					throw Except("cannot set cipher");
-			if (g_opt.tls_vers == TLS1_2_VERSION
-			    || g_opt.tls_vers == TLS_ANY_VERSION)
-				if (!SSL_CTX_set_cipher_list(tls_ctx_,
-							     g_opt.cipher))
-					throw Except("cannot set cipher");
-		}
-		if (g_opt.curve)
-			if (!SSL_CTX_set1_groups_list(tls_ctx_, g_opt.curve))
-				throw Except("cannot set elliptic curve");
-		SSL_CTX_set_verify(tls_ctx_, SSL_VERIFY_NONE, NULL);
-		if (g_opt.keylogfile)
-			SSL_CTX_set_keylog_callback(tls_ctx_, keylog);
+static int
+rsl_add_cb(SSL *tls, unsigned int ext_type, unsigned int context,
+	   const unsigned char **out, size_t *outlen, X509 *x,
+	   size_t chainidx, int *al, void *arg)
+{
+	static thread_local unsigned char data[2];
 
-		if ((ed_ = epoll_create(1)) < 0)
-			throw Except("can't create epoll");
-		memset(events_, 0, sizeof(events_));
-	}
+	int limit = (intptr_t)arg;
 
-	~IO()
-	{
-		if (ed_ > -1)
-			close(ed_);
-		reconnect_q_.clear();
-		SSL_CTX_set_keylog_callback(tls_ctx_, nullptr);
-		if (tls_ctx_)
-			SSL_CTX_free(tls_ctx_);
-	}
+	data[0] = limit >> 8;
+	data[1] = limit & 0xff;
+	*out = data;
+	*outlen = sizeof(data);
+	return 1;
+}
 
-	void
-	add(SocketHandler *sh)
-	{
-		struct epoll_event ev = {
-			.events = EPOLLIN | EPOLLOUT | EPOLLERR,
-			.data = { .ptr = sh }
-		};
+static int
+rsl_parse_cb(SSL *tls, unsigned int ext_type, unsigned int context,
+	     const unsigned char *in, size_t inlen, X509 *x,
+	     size_t chainidx, int *al, void *arg)
+{
+	auto sh = (SocketHandler *)SSL_get_app_data(tls);
 
-		if (epoll_ctl(ed_, EPOLL_CTL_ADD, sh->sd, &ev) < 0)
-			throw Except("can't add socket to poller");
+	if (inlen != 2) {
+		*al = SSL_AD_DECODE_ERROR;
+		return 0;
 	}
+	if (sh)
+		sh->hs.rsl = in[0] << 8 | in[1];
+	return 1;
+}
 
-	void
-	del(SocketHandler *sh)
-	{
-		if (epoll_ctl(ed_, EPOLL_CTL_DEL, sh->sd, NULL) < 0)
-			throw Except("can't delete socket from poller");
-	}
+/**
+ * RFC 8879 certificate compression algorithms, index is the code point.
+ */
+static const char *cert_comp_algs[] = {
+	"none", "zlib", "brotli", "zstd"
+};
+static const int N_CERT_COMP_ALGS = sizeof(cert_comp_algs)
+				    / sizeof(*cert_comp_algs);
+
+// OpenSSL before 3.2 doesn't know the message.
+#ifndef SSL3_MT_COMPRESSED_CERTIFICATE
+#define SSL3_MT_COMPRESSED_CERTIFICATE	25
+#endif
+
+static const unsigned char HRR_RANDOM[32] = {
+	0xcf, 0x21, 0xad, 0x74, 0xe5, 0x9a, 0x61, 0x11,
+	0xbe, 0x1d, 0x8c, 0x02, 0x1e, 0x65, 0xb8, 0x91,
+	0xc2, 0xa2, 0x11, 0x16, 0x7a, 0xbb, 0x8c, 0x5e,
+	0x07, 0x9e, 0x09, 0xe2, 0xc8, 0xa8, 0x33, 0x9c
+};
 
-	void
-	queue_reconnect(SocketHandler *sh) noexcept
-	{
-		reconnect_q_.push_back(sh);
-	}
+/**
+ * Find extension @type in ClientHello or ServerHello @ch, skipping the
+ * message header. Returns the extension data and its size in @ext_len or
+ * NULL.
+ */
+static const unsigned char *
+hello_find_ext(const unsigned char *ch, size_t len, int type, size_t *ext_len)
+	noexcept
+{
+	// Header, legacy_version and random.
+	size_t off = 4 + 2 + 32;
 
-	void
+	if (off + 1 > len)
+		return NULL;
+	off += 1 + ch[off]; // legacy_session_id
+	if (ch[0] == SSL3_MT_SERVER_HELLO) {
+		off += 2 + 1; // cipher_suite, legacy_compression_method
+	} else {
+		if (off + 2 > len)
+			return NULL;
+		off += 2 + (ch[off] << 8 | ch[off + 1]); // cipher_suites
+		if (off + 1 > len)
+			return NULL;
+		off += 1 + ch[off]; // legacy_compression_methods
+	}
+	if (off + 2 > len)
+		return NULL;
+	off += 2;
+	while (off + 4 <= len) {
+		int t = ch[off] << 8 | ch[off + 1];
+		size_t n = ch[off + 2] << 8 | ch[off + 3];
+		off += 4;
+		if (off + n > len)
+			return NULL;
+		if (t == type) {
+			*ext_len = n;
+			return ch + off;
+		}
+		off += n;
+	}
+	return NULL;
+}
+
+/**
+ * Count key shares in the first ClientHello and detect HelloRetryRequest,
+ * which is ServerHello with the special random value.
+ */
+static void
+hs_msg_cb(int write_p, int version, int content_type, const void *buf,
+	  size_t len, SSL *tls, void *arg)
+{
+	auto sh = (SocketHandler *)SSL_get_app_data(tls);
+	auto msg = (const unsigned char *)buf;
+
+	if (!sh)
+		return;
+	if (content_type == SSL3_RT_HEADER && !SSL_is_init_finished(tls)) {
+		if (write_p)
+			sh->hs.recs_out++;
+		else
+			sh->hs.recs_in++;
+		return;
+	}
+	if (content_type == SSL3_RT_ALERT && !write_p && len == 2) {
+		sh->hs.alert = msg[1];
+		return;
+	}
+	if (content_type != SSL3_RT_HANDSHAKE || len < 4)
+		return;
+	if (!write_p && !sh->hs.finished)
+		sh->hs.srv_len += len;
+
+	if (write_p && msg[0] == SSL3_MT_CLIENT_HELLO && !sh->hs.hrr) {
+		size_t n = 0;
+		auto ks = hello_find_ext(msg, len, TLSEXT_TYPE_key_share, &n);
+		sh->hs.ch_len = len;
+		sh->hs.key_shares = 0;
+		if (!ks || n < 2)
+			return;
+		// client_shares list: group (2), key length (2), key.
+		for (size_t off = 2; off + 4 <= n; ) {
+			off += 4 + (ks[off + 2] << 8 | ks[off + 3]);
+			sh->hs.key_shares++;
+		}
+	}
+	else if (!write_p && msg[0] == SSL3_MT_SERVER_HELLO) {
+		size_t n;
+		if (len >= 4 + 2 + 32
+		    && !memcmp(msg + 6, HRR_RANDOM, sizeof(HRR_RANDOM))) {
+			sh->hs.hrr = true;
+		} else {
+			sh->hs.sh_len = len;
+			sh->hs.sh_key_share = hello_find_ext(msg, len,
+							     TLSEXT_TYPE_key_share,
+							     &n);
+		}
+	}
+	else if (!write_p && msg[0] == SSL3_MT_CERTIFICATE && !sh->hs.finished) {
+		sh->hs.cert_len = sh->hs.cert_raw_len = len;
+	}
+	else if (!write_p && msg[0] == SSL3_MT_COMPRESSED_CERTIFICATE
+		 && len >= 4 + 2 + 3 && !sh->hs.finished)
+	{
+		// algorithm (2), uncompressed_length (3), compressed data.
+		sh->hs.cert_comp = msg[4] << 8 | msg[5];
+		sh->hs.cert_len = len;
+		sh->hs.cert_raw_len = 4 + (msg[6] << 16 | msg[7] << 8 | msg[8]);
+	}
+	else if (!write_p && msg[0] == SSL3_MT_CERTIFICATE_REQUEST) {
+		// CertificateRequest after our Finished is post-handshake
+		// authentication, which completes with our next Finished.
+		if (sh->hs.finished)
+			sh->hs.pha = HsInfo::PHA_REQUESTED;
+		else
+			sh->hs.cert_req = true;
+	}
+	else if (!write_p && msg[0] == SSL3_MT_KEY_UPDATE) {
+		sh->hs.key_update = true;
+	}
+	else if (write_p && msg[0] == SSL3_MT_FINISHED) {
+		if (sh->hs.pha == HsInfo::PHA_REQUESTED)
+			sh->hs.pha = HsInfo::PHA_ANSWERED;
+		sh->hs.finished = true;
+	}
+}
+
+/**
+ * Copy the session with a damaged ticket, or with a random session ID for
+ * sessions without tickets, so that the server can't resume it. The ticket
+ * has no setter, so patch it in the serialized session.
+ */
+static SSL_SESSION *
+sess_corrupt(SSL_SESSION *sess)
+{
+	const unsigned char *tick;
+	size_t tick_len;
+
+	SSL_SESSION_get0_ticket(sess, &tick, &tick_len);
+	if (!tick_len) {
+		unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+		for (auto &b : id)
+			b = rng();
+		SSL_SESSION *s = SSL_SESSION_dup(sess);
+		if (!s || !SSL_SESSION_set1_id(s, id, sizeof(id)))
+			throw Except("cannot corrupt session");
+		return s;
+	}
+
+	int n = i2d_SSL_SESSION(sess, NULL);
+	std::vector<unsigned char> der(n > 0 ? n : 0);
+	unsigned char *p = der.data();
+	if (n <= 0 || i2d_SSL_SESSION(sess, &p) != n)
+		throw Except("cannot serialize session");
+	auto t = (unsigned char *)memmem(der.data(), n, tick, tick_len);
+	if (!t)
+		throw Except("cannot find session ticket");
+	// The key name comes first in OpenSSL and most of the servers.
+	for (size_t i = 0; i < tick_len; i += 16)
+		t[i] ^= 0xff;
+
+	const unsigned char *q = der.data();
+	SSL_SESSION *s = d2i_SSL_SESSION(NULL, &q, n);
+	if (!s)
+		throw Except("cannot corrupt session");
+	return s;
+}
+
+/**
+ * TLS 1.3 session tickets come after the handshake, so we get the sessions
+ * by the callback rather than by SSL_get1_session() on closing.
+ */
+static int
+new_session_cb(SSL *tls, SSL_SESSION *sess)
+{
+	if (SSL_version(tls) != TLS1_3_VERSION)
+		return 0;
+
+	auto sh = (SocketHandler *)SSL_get_app_data(tls);
+	sh->put_session(sess);
+	return 1;
+}
+
+/**
+ * Convert the comma separated ALPN list to the wire format.
+ */
+static bool
+alpn_wire(const std::string &list, std::string &wire)
+{
+	std::istringstream ss(list);
+
+	wire.clear();
+	for (std::string p; std::getline(ss, p, ','); ) {
+		if (p.empty() || p.size() > 255)
+			return false;
+		wire.push_back((char)p.size());
+		wire.append(p);
+	}
+	return !wire.empty();
+}
+
+/**
+ * GREASE (RFC 8701) extensions like browsers send: an empty one and a one
+ * byte one. Browsers pick random GREASE values for each connection, but
+ * OpenSSL needs the custom extension types in advance, and servers must
+ * ignore any of them anyway.
+ */
+static const unsigned int TLSEXT_GREASE_FIRST = 0x0a0a;
+static const unsigned int TLSEXT_GREASE_LAST = 0xfafa;
+
+static int
+grease_add_cb(SSL *tls, unsigned int ext_type, unsigned int context,
+	      const unsigned char **out, size_t *outlen, X509 *x,
+	      size_t chainidx, int *al, void *arg)
+{
+	static const unsigned char data[1] = {};
+
+	*out = data;
+	*outlen = ext_type == TLSEXT_GREASE_LAST ? sizeof(data) : 0;
+	return 1;
+}
+
+/**
+ * OpenSSL has no client API for the configured groups, so read the supported
+ * groups from ClientHello of a client with the groups @list, or with the
+ * default groups for NULL. Returns the groups names as OpenSSL reports them,
+ * or an empty string on failure.
+ */
+static std::string
+groups_hello_read(const char *list) noexcept
+{
+	std::string groups;
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	SSL *tls = ctx && (!list || SSL_CTX_set1_groups_list(ctx, list))
+		   ? SSL_new(ctx) : NULL;
+	BIO *rbio = BIO_new(BIO_s_mem()), *wbio = BIO_new(BIO_s_mem());
+
+	if (!tls || !rbio || !wbio) {
+		BIO_free(rbio);
+		BIO_free(wbio);
+		goto out;
+	}
+	SSL_set_bio(tls, rbio, wbio);
+	SSL_set_connect_state(tls);
+	if (SSL_do_handshake(tls) != 1) {
+		unsigned char *rec;
+		long len = BIO_get_mem_data(wbio, &rec);
+		size_t n = 0;
+		// Skip the record header.
+		auto sg = len > 5 ? hello_find_ext(rec + 5, len - 5,
+						   TLSEXT_TYPE_supported_groups,
+						   &n)
+				  : NULL;
+		// named_group_list length (2), groups.
+		for (size_t off = 2; sg && off + 2 <= n; off += 2) {
+			int id = sg[off] << 8 | sg[off + 1];
+			auto name = SSL_group_to_name(tls, id | TLSEXT_nid_unknown);
+			if (name)
+				groups += (groups.empty() ? "" : ":")
+					  + std::string(name);
+		}
+	}
+out:
+	SSL_free(tls);
+	SSL_CTX_free(ctx);
+	ERR_clear_error();
+	return groups;
+}
+
+static const std::string &
+groups_default() noexcept
+{
+	static const std::string groups = groups_hello_read(NULL);
+	return groups;
+}
+
+/**
+ * The name of group @name as OpenSSL reports it, e.g. 'secp256r1' for 'P-256',
+ * to match it against the default groups.
+ */
+static std::string
+group_name(const std::string &name) noexcept
+{
+	auto res = groups_hello_read(name.c_str());
+	return res.empty() ? name : res;
+}
+
+/**
+ * Build the groups list with the key share groups first. OpenSSL before 3.5
+ * sends a key share only for the first group, the newer versions send key
+ * shares for all the groups marked with '*'. Without -C the key share groups
+ * are moved to the front of the library default list.
+ */
+static std::string
+groups_list(const Opts &o)
+{
+	std::string groups = o.curve ? : groups_default();
+	if (!o.key_share)
+		return groups;
+
+	std::vector<std::string> ks, res;
+	std::stringstream ss_ks(o.key_share), ss_g(groups);
+	std::string g;
+
+	while (std::getline(ss_ks, g, ':')) {
+		ks.push_back(o.curve ? g : group_name(g));
+#if OPENSSL_VERSION_NUMBER >= 0x30500000L
+		res.push_back("*" + g);
+#else
+		res.push_back(g);
+#endif
+	}
+	while (std::getline(ss_g, g, ':'))
+		if (std::find(ks.begin(), ks.end(), g) == ks.end())
+			res.push_back(g);
+
+	groups.clear();
+	for (auto &r : res)
+		groups += (groups.empty() ? "" : ":") + r;
+	return groups;
+}
+
+/**
+ * Only some of the statistics read the handshake messages, so don't slow
+ * down the other runs with the message callback.
+ */
+static bool
+hs_msg_needed(const Opts &o) noexcept
+{
+	return o.curve || o.key_share || o.cert_comp || o.max_frag
+	       || o.record_limit || o.client_certs || o.pha || o.psk
+	       || o.reject || o.rekey.type != Dist::NONE;
+}
+
+static SSL_CTX *
+tls_ctx_create(const Opts &o)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx)
+		throw Except("cannot create TLS context");
+
+	// Allow only TLS 1.2 and 1.3, and chose only those user has
+	// requested.
+	if (o.tls_vers != TLS_ANY_VERSION) {
+		SSL_CTX_set_min_proto_version(ctx, o.tls_vers);
+		SSL_CTX_set_max_proto_version(ctx, o.tls_vers);
+	} else {
+		SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+		SSL_CTX_set_max_proto_version(ctx, TLS1_3_VERSION);
+	}
+
+	// Session resumption.
+	if (o.resume == RESUME_ID)
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	// OpenSSL always offers psk_dhe_ke and adds psk_ke only with
+	// the option, so the server makes the final choice.
+	else if (o.resume == RESUME_PSK_KE || o.psk_ke)
+		SSL_CTX_set_options(ctx, SSL_OP_ALLOW_NO_DHE_KEX);
+	if (!o.use_tickets) {
+		unsigned int mode = SSL_SESS_CACHE_OFF
+				  | SSL_SESS_CACHE_NO_INTERNAL;
+		if (!o.adv_tickets)
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		SSL_CTX_set_session_cache_mode(ctx, mode);
+	}
+	else {
+		unsigned int mode = SSL_SESS_CACHE_CLIENT
+				  | SSL_SESS_CACHE_NO_AUTO_CLEAR;
+		SSL_CTX_set_session_cache_mode(ctx, mode);
+		SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+	}
+
+	if (o.cipher) {
+		if (o.tls_vers == TLS1_3_VERSION
+		    || o.tls_vers == TLS_ANY_VERSION)
+			if (!SSL_CTX_set_ciphersuites(ctx,
+						      o.cipher))
+				throw Except("cannot set cipher");
+		if (o.tls_vers == TLS1_2_VERSION
+		    || o.tls_vers == TLS_ANY_VERSION)
+			if (!SSL_CTX_set_cipher_list(ctx,
+						     o.cipher))
+				throw Except("cannot set cipher");
+	}
+	if (o.curve || o.key_share)
+		if (!SSL_CTX_set1_groups_list(ctx, groups_list(o).c_str()))
+			throw Except("cannot set elliptic curve");
+	if (hs_msg_needed(o))
+		SSL_CTX_set_msg_callback(ctx, hs_msg_cb);
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+	if (o.cert_comp && !strcmp(o.cert_comp, "none")) {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_RX_CERTIFICATE_COMPRESSION);
+	}
+	else if (o.cert_comp) {
+		std::vector<int> algs;
+		std::stringstream ss(o.cert_comp);
+		std::string a;
+		while (std::getline(ss, a, ':'))
+			for (int i = 1; i < N_CERT_COMP_ALGS; ++i)
+				if (a == cert_comp_algs[i])
+					algs.push_back(i);
+		if (!SSL_CTX_set1_cert_comp_preference(ctx, algs.data(),
+						       algs.size()))
+			throw Except("cannot set certificate compression");
+	}
+#endif
+	if (o.pha)
+		SSL_CTX_set_post_handshake_auth(ctx, 1);
+	if (o.sigalgs && strcmp(o.sigalgs, "any")
+	    && !SSL_CTX_set1_sigalgs_list(ctx, o.sigalgs))
+		throw Except("cannot set signature algorithms");
+	if (o.max_frag
+	    && !SSL_CTX_set_tlsext_max_fragment_length(ctx, o.max_frag))
+		throw Except("cannot set max fragment length");
+	if (o.record_limit
+	    && !SSL_CTX_add_custom_ext(ctx, TLSEXT_RECORD_SIZE_LIMIT,
+				       SSL_EXT_CLIENT_HELLO
+				       | SSL_EXT_TLS1_2_SERVER_HELLO
+				       | SSL_EXT_TLS1_3_ENCRYPTED_EXTENSIONS,
+				       rsl_add_cb, NULL,
+				       (void *)(intptr_t)o.record_limit,
+				       rsl_parse_cb, NULL))
+		throw Except("cannot add record size limit extension");
+	if (o.ocsp
+	    && !SSL_CTX_set_tlsext_status_type(ctx, TLSEXT_STATUSTYPE_ocsp))
+		throw Except("cannot request OCSP stapling");
+	if (o.alpn) {
+		std::string wire;
+		if (!alpn_wire(o.alpn, wire)
+		    || SSL_CTX_set_alpn_protos(ctx, (const unsigned char *)
+						    wire.data(), wire.size()))
+			throw Except("cannot set ALPN");
+	}
+	if (o.grease)
+		for (auto t : {TLSEXT_GREASE_FIRST, TLSEXT_GREASE_LAST})
+			if (!SSL_CTX_add_custom_ext(ctx, t,
+						    SSL_EXT_CLIENT_HELLO,
+						    grease_add_cb, NULL, NULL,
+						    NULL, NULL))
+				throw Except("cannot add GREASE extension");
+	if (o.padding)
+		SSL_CTX_set_options(ctx, SSL_OP_TLSEXT_PADDING);
+	if (o.verify) {
+		SSL_CTX_set1_cert_store(ctx, g_verify.store);
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		SSL_CTX_set_cert_verify_callback(ctx, verify_cb, NULL);
+		if (o.verify_host
+		    && !X509_VERIFY_PARAM_set1_host(SSL_CTX_get0_param(ctx),
+						    o.verify_host, 0))
+			throw Except("cannot set host name for verification");
+	} else {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	}
+	if (o.keylogfile)
+		SSL_CTX_set_keylog_callback(ctx, keylog);
+
+	// Override the settings, so the server has nothing to choose from.
+	// The obsolete versions and the NULL ciphers need the lowest
+	// security level.
+	switch (o.reject) {
+	case REJECT_VERSION:
+		SSL_CTX_set_security_level(ctx, 0);
+		SSL_CTX_set_min_proto_version(ctx, TLS1_VERSION);
+		SSL_CTX_set_max_proto_version(ctx, TLS1_VERSION);
+		break;
+	case REJECT_CIPHER:
+		SSL_CTX_set_security_level(ctx, 0);
+		if (!SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_CCM_8_SHA256")
+		    || !SSL_CTX_set_cipher_list(ctx, "NULL-SHA256:NULL-SHA"))
+			throw Except("cannot set cipher");
+		break;
+	case REJECT_GROUP:
+		// Servers rarely enable Brainpool curves, and TLS 1.2 servers
+		// can't fall back to DHE or RSA key exchange with ECDHE only.
+		// The TLS 1.3 Brainpool groups appeared in OpenSSL 3.2 and are
+		// used only with -V 1.3, otherwise the handshake is pinned to
+		// TLS 1.2, which print_settings() reports.
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+		if (o.tls_vers == TLS1_3_VERSION) {
+			if (!SSL_CTX_set1_groups_list(ctx,
+						      "brainpoolP512r1tls13"))
+				throw Except("cannot set elliptic curve");
+			break;
+		}
+#endif
+		SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+		SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+		if (!SSL_CTX_set_cipher_list(ctx, "ECDHE")
+		    || !SSL_CTX_set1_groups_list(ctx, "brainpoolP512r1"))
+			throw Except("cannot set elliptic curve");
+		break;
+	}
+
+	return ctx;
+}
+
+/**
+ * Per-thread TLS contexts cached by their settings, so that benchmark runs
+ * with the same settings, e.g. scenario phases or thread sweep steps, reuse
+ * warm contexts.
+ */
+static struct {
+	std::mutex				lock;
+	std::map<std::string, SSL_CTX *>	ctx;
+} g_tls_ctx;
+
+/**
+ * All the options applied to the TLS context by tls_ctx_create().
+ */
+static std::string
+tls_ctx_key(int thr, const Opts &o)
+{
+	std::stringstream ss;
+
+	ss << thr << " " << o.tls_vers
+	   << " " << o.use_tickets << " " << o.adv_tickets
+	   << " " << o.resume << " " << o.reject << " " << o.psk_ke
+	   << " " << (o.cipher ? : "-") << " " << (o.curve ? : "-")
+	   << " " << (o.key_share ? : "-") << " " << o.pha
+	   << " " << (o.cert_comp ? : "-") << " " << o.ocsp
+	   << " " << (o.sigalgs ? : "-")
+	   << " " << o.max_frag << " " << o.record_limit
+	   << " " << (o.alpn ? : "-") << " " << o.grease << " " << o.padding
+	   << " " << (o.verify ? : "-")
+	   << " " << (o.verify_host ? : "-") << " " << hs_msg_needed(o);
+
+	return ss.str();
+}
+
+static SSL_CTX *
+tls_ctx_get(int thr, const Opts &o)
+{
+	auto key = tls_ctx_key(thr, o);
+
+	std::lock_guard<std::mutex> _(g_tls_ctx.lock);
+	auto &ctx = g_tls_ctx.ctx[key];
+	if (!ctx)
+		ctx = tls_ctx_create(o);
+	return ctx;
+}
+
+/**
+ * Connection classes with different TLS settings, each new connection
+ * picks a class by the class weight.
+ */
+struct MixClass {
+	std::string			name;
+	unsigned int			weight;
+	std::vector<std::string>	args;
+	Opts				opt;
+};
+
+static struct {
+	std::vector<MixClass>	cls;
+	unsigned int		total;
+} g_mix;
+
+static int
+mix_pick() noexcept
+{
+	unsigned int w = rng() % g_mix.total;
+	int i = 0;
+
+	while (w >= g_mix.cls[i].weight)
+		w -= g_mix.cls[i++].weight;
+	return i;
+}
+
+static void
+tls_ctx_free_all() noexcept
+{
+	for (auto &c : g_tls_ctx.ctx)
+		if (c.second) {
+			SSL_CTX_set_keylog_callback(c.second, nullptr);
+			SSL_CTX_free(c.second);
+		}
+	g_tls_ctx.ctx.clear();
+}
+
+/**
+ * Sessions shared by all the threads. Any thread can draw a session from
+ * the pool, and the session is removed from the pool, so each session is used
+ * only once, just like browsers do with TLS 1.3 tickets. The session of each
+ * completed connection goes back to the pool.
+ *
+ * Sessions preloaded from a file are used first. The file is memory mapped
+ * and only the record offsets are indexed on loading, each session is decoded
+ * when it's drawn from the pool.
+ */
+static struct {
+	std::mutex			lock;
+	std::deque<SSL_SESSION *>	sess;
+	uint64_t			empty_draws;
+
+	const unsigned char		*map;
+	size_t				map_sz;
+	std::vector<size_t>		off;
+	std::atomic<size_t>		next;
+} g_sess_pool;
+
+static SSL_SESSION *
+sess_pool_get_preloaded() noexcept
+{
+	size_t i;
+
+	while ((i = g_sess_pool.next++) < g_sess_pool.off.size()) {
+		const unsigned char *p = g_sess_pool.map + g_sess_pool.off[i];
+		long len = (p[0] << 8) | p[1];
+
+		p += 2;
+		if (auto sess = d2i_SSL_SESSION(NULL, &p, len))
+			return sess;
+		dbg << "cannot decode preloaded session " << i << std::endl;
+	}
+	return NULL;
+}
+
+static SSL_SESSION *
+sess_pool_get() noexcept
+{
+	if (g_sess_pool.next < g_sess_pool.off.size())
+		if (auto sess = sess_pool_get_preloaded())
+			return sess;
+
+	std::lock_guard<std::mutex> _(g_sess_pool.lock);
+
+	if (g_sess_pool.sess.empty()) {
+		g_sess_pool.empty_draws++;
+		return NULL;
+	}
+	// Use the freshest sessions.
+	auto sess = g_sess_pool.sess.back();
+	g_sess_pool.sess.pop_back();
+	return sess;
+}
+
+static void
+sess_pool_put(SSL_SESSION *sess) noexcept
+{
+	if (!sess)
+		return;
+	if (!SSL_SESSION_is_resumable(sess)) {
+		SSL_SESSION_free(sess);
+		return;
+	}
+
+	SSL_SESSION *old = NULL;
+	{
+		std::lock_guard<std::mutex> _(g_sess_pool.lock);
+		if (g_sess_pool.sess.size() >= g_opt.sess_pool_max) {
+			old = g_sess_pool.sess.front();
+			g_sess_pool.sess.pop_front();
+		}
+		g_sess_pool.sess.push_back(sess);
+	}
+	SSL_SESSION_free(old);
+}
+
+/**
+ * Index the sessions file, which is mapped into memory for the whole
+ * program life time.
+ */
+static int
+sess_pool_load(const char *path) noexcept
+{
+	off_t sz = -1;
+	void *map;
+	int fd;
+
+	// sys/stat.h conflicts with our global @stat, so use lseek().
+	if ((fd = open(path, O_RDONLY)) < 0
+	    || (sz = lseek(fd, 0, SEEK_END)) < 0)
+	{
+		std::cerr << "ERROR: cannot open sessions file '" << path
+			  << "': " << strerror(errno) << std::endl;
+		if (fd >= 0)
+			close(fd);
+		return -ENOENT;
+	}
+	if ((size_t)sz < sizeof(SESS_FILE_MAGIC)) {
+		close(fd);
+		goto bad_file;
+	}
+	map = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		std::cerr << "ERROR: cannot map sessions file '" << path
+			  << "': " << strerror(errno) << std::endl;
+		return -ENOMEM;
+	}
+	g_sess_pool.map = (const unsigned char *)map;
+	g_sess_pool.map_sz = sz;
+	if (memcmp(map, SESS_FILE_MAGIC, sizeof(SESS_FILE_MAGIC)))
+		goto bad_file;
+
+	for (size_t off = sizeof(SESS_FILE_MAGIC); off < g_sess_pool.map_sz; )
+	{
+		if (off + 2 > g_sess_pool.map_sz)
+			goto bad_file;
+		size_t len = (g_sess_pool.map[off] << 8)
+			     | g_sess_pool.map[off + 1];
+		if (off + 2 + len > g_sess_pool.map_sz)
+			goto bad_file;
+		g_sess_pool.off.push_back(off);
+		off += 2 + len;
+	}
+	g_sess_pool.next = 0;
+
+	if (!g_opt.quiet)
+		std::cout << "preloaded " << g_sess_pool.off.size()
+			  << " sessions from " << path << std::endl;
+	return 0;
+bad_file:
+	std::cerr << "ERROR: bad sessions file '" << path << "'" << std::endl;
+	return -EINVAL;
+}
+
+/**
+ * Save the unused preloaded sessions and all the pooled sessions, so the next
+ * run can start with warm sessions. Write a temporary file first since we may
+ * rewrite the mapped file.
+ */
+static void
+sess_pool_save(const char *path) noexcept
+{
+	std::string tmp = std::string(path) + ".tmp";
+	std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+	std::vector<unsigned char> buf;
+	size_t n = 0;
+
+	if (!f) {
+		std::cerr << "ERROR: cannot write sessions file '" << tmp << "'"
+			  << std::endl;
+		return;
+	}
+	f.write(SESS_FILE_MAGIC, sizeof(SESS_FILE_MAGIC));
+
+	for (size_t i = g_sess_pool.next; i < g_sess_pool.off.size(); ++i) {
+		const unsigned char *p = g_sess_pool.map + g_sess_pool.off[i];
+		f.write((const char *)p, 2 + ((p[0] << 8) | p[1]));
+		++n;
+	}
+	for (auto sess : g_sess_pool.sess) {
+		int len = i2d_SSL_SESSION(sess, NULL);
+		if (len <= 0 || len > 0xffff)
+			continue;
+		buf.resize(len + 2);
+		buf[0] = len >> 8;
+		buf[1] = len & 0xff;
+		unsigned char *p = buf.data() + 2;
+		i2d_SSL_SESSION(sess, &p);
+		f.write((const char *)buf.data(), buf.size());
+		++n;
+	}
+
+	f.close();
+	if (!f || rename(tmp.c_str(), path)) {
+		std::cerr << "ERROR: cannot write sessions file '" << path
+			  << "'" << std::endl;
+		return;
+	}
+	if (!g_opt.quiet)
+		std::cout << "saved " << n << " sessions to " << path
+			  << std::endl;
+}
+
+static void
+sess_pool_free_all() noexcept
+{
+	for (auto sess : g_sess_pool.sess)
+		SSL_SESSION_free(sess);
+	g_sess_pool.sess.clear();
+
+	if (g_sess_pool.map) {
+		munmap((void *)g_sess_pool.map, g_sess_pool.map_sz);
+		g_sess_pool.map = NULL;
+	}
+	g_sess_pool.off.clear();
+}
+
+/**
+ * Read certificates and keys from the PEM file: each key pairs with the
+ * certificates preceding it, the first of them is the client certificate
+ * and the rest is its chain.
+ */
+static int
+client_certs_load_file(const char *path, std::vector<X509 *> &certs) noexcept
+{
+	BIO *bio = BIO_new_file(path, "r");
+	if (!bio) {
+		std::cerr << "ERROR: cannot open client certificates file '"
+			  << path << "'" << std::endl;
+		return -ENOENT;
+	}
+	STACK_OF(X509_INFO) *infos = PEM_X509_INFO_read_bio(bio, NULL, NULL,
+							    NULL);
+	BIO_free(bio);
+	if (!infos) {
+		std::cerr << "ERROR: bad client certificates file '" << path
+			  << "'" << std::endl;
+		return -EINVAL;
+	}
+
+	int r = 0;
+	for (int i = 0; i < sk_X509_INFO_num(infos); ++i) {
+		X509_INFO *xi = sk_X509_INFO_value(infos, i);
+		if (xi->x509) {
+			X509_up_ref(xi->x509);
+			certs.push_back(xi->x509);
+		}
+		if (!xi->x_pkey)
+			continue;
+		if (certs.empty()) {
+			std::cerr << "ERROR: key without certificate in '"
+				  << path << "'" << std::endl;
+			r = -EINVAL;
+			break;
+		}
+
+		ClientCert cc;
+		cc.cert = certs[0];
+		cc.key = xi->x_pkey->dec_pkey;
+		EVP_PKEY_up_ref(cc.key);
+		cc.chain = sk_X509_new_null();
+		for (size_t j = 1; j < certs.size(); ++j)
+			sk_X509_push(cc.chain, certs[j]);
+		certs.clear();
+		g_client_certs.certs.push_back(cc);
+
+		if (!X509_check_private_key(cc.cert, cc.key)) {
+			std::cerr << "ERROR: client certificate doesn't match"
+				     " its key in '" << path << "'"
+				  << std::endl;
+			r = -EINVAL;
+			break;
+		}
+	}
+	sk_X509_INFO_pop_free(infos, X509_INFO_free);
+	return r;
+}
+
+/**
+ * Load client certificates from a PEM bundle or from all the files in
+ * a directory in the name order, so a key may follow its certificate in
+ * a separate file, e.g. client.crt and client.key.
+ */
+static int
+client_certs_load(const char *path) noexcept
+{
+	std::vector<X509 *> certs;
+	int r = 0;
+
+	if (DIR *d = opendir(path)) {
+		std::vector<std::string> files;
+		while (struct dirent *de = readdir(d))
+			if (de->d_name[0] != '.')
+				files.push_back(std::string(path) + "/"
+						+ de->d_name);
+		closedir(d);
+		std::sort(files.begin(), files.end());
+		for (auto &f : files)
+			if ((r = client_certs_load_file(f.c_str(), certs)))
+				break;
+	} else {
+		r = client_certs_load_file(path, certs);
+	}
+
+	for (auto c : certs)
+		X509_free(c);
+	if (!r && !certs.empty()) {
+		std::cerr << "ERROR: client certificate without key in '"
+			  << path << "'" << std::endl;
+		r = -EINVAL;
+	}
+	if (!r && g_client_certs.certs.empty()) {
+		std::cerr << "ERROR: no client certificates in '" << path
+			  << "'" << std::endl;
+		r = -EINVAL;
+	}
+	return r;
+}
+
+static void
+client_certs_free_all() noexcept
+{
+	for (auto &cc : g_client_certs.certs) {
+		X509_free(cc.cert);
+		EVP_PKEY_free(cc.key);
+		sk_X509_pop_free(cc.chain, X509_free);
+	}
+	g_client_certs.certs.clear();
+}
+
+/**
+ * Present the next client certificate in round-robin or random order.
+ */
+static void
+client_cert_set(SSL *tls)
+{
+	auto &certs = g_client_certs.certs;
+	size_t i = g_opt.client_cert_random ? rng() % certs.size()
+					    : g_client_certs.next++ % certs.size();
+	auto &cc = certs[i];
+
+	if (!SSL_use_cert_and_key(tls, cc.cert, cc.key, cc.chain, 1))
+		throw Except("cannot set client certificate");
+}
+
+/**
+ * TLS 1.3 external PSKs: identities with sessions holding the keys and
+ * the ciphers, offered in round-robin order.
+ */
+struct ExtPsk {
+	std::string		identity;
+	SSL_SESSION		*sess;
+};
+
+static struct {
+	std::vector<ExtPsk>	ent;
+	std::atomic<uint64_t>	next;
+} g_psk;
+
+static SSL_CIPHER const *
+psk_cipher(SSL *tls, const std::string &name) noexcept
+{
+	STACK_OF(SSL_CIPHER) *ciphers = SSL_get_ciphers(tls);
+
+	for (int i = 0; i < sk_SSL_CIPHER_num(ciphers); ++i) {
+		auto c = sk_SSL_CIPHER_value(ciphers, i);
+		if (SSL_CIPHER_get_protocol_id(c) >> 8 == 0x13
+		    && name == SSL_CIPHER_get_name(c))
+			return c;
+	}
+	return NULL;
+}
+
+/**
+ * Parse the PSK file lines in the form
+ *	<identity> <hex key> [<TLS 1.3 cipher>]
+ * The cipher defines the PSK hash and defaults to TLS_AES_128_GCM_SHA256.
+ */
+static int
+psk_load(const char *path) noexcept
+{
+	std::ifstream f(path);
+	std::string line;
+	int r = 0;
+
+	if (!f) {
+		std::cerr << "ERROR: cannot open PSK file '" << path << "'"
+			  << std::endl;
+		return -ENOENT;
+	}
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	SSL *tls = ctx ? SSL_new(ctx) : NULL;
+	if (!tls) {
+		SSL_CTX_free(ctx);
+		return -ENOMEM;
+	}
+	while (std::getline(f, line)) {
+		auto c = line.find('#');
+		if (c != std::string::npos)
+			line.resize(c);
+
+		std::istringstream ss(line);
+		std::string id, key, cipher = "TLS_AES_128_GCM_SHA256";
+		if (!(ss >> id))
+			continue;
+		ss >> key >> cipher;
+
+		std::string extra;
+		long key_len = 0;
+		unsigned char *k = OPENSSL_hexstr2buf(key.c_str(), &key_len);
+		auto ciph = psk_cipher(tls, cipher);
+		SSL_SESSION *sess = SSL_SESSION_new();
+		if (!k || key_len <= 0 || !ciph || !sess || ss >> extra
+		    || !SSL_SESSION_set1_master_key(sess, k, key_len)
+		    || !SSL_SESSION_set_cipher(sess, ciph)
+		    || !SSL_SESSION_set_protocol_version(sess, TLS1_3_VERSION))
+		{
+			std::cerr << "ERROR: bad PSK '" << line << "'"
+				  << std::endl;
+			OPENSSL_free(k);
+			SSL_SESSION_free(sess);
+			r = -EINVAL;
+			break;
+		}
+		OPENSSL_free(k);
+		g_psk.ent.push_back({id, sess});
+	}
+	SSL_free(tls);
+	SSL_CTX_free(ctx);
+	ERR_clear_error();
+
+	if (!r && g_psk.ent.empty()) {
+		std::cerr << "ERROR: no PSKs in '" << path << "'" << std::endl;
+		r = -EINVAL;
+	}
+	return r;
+}
+
+static void
+psk_free_all() noexcept
+{
+	for (auto &p : g_psk.ent)
+		SSL_SESSION_free(p.sess);
+	g_psk.ent.clear();
+}
+
+/**
+ * Offer the PSK of the connection. OpenSSL calls the callback again after
+ * HelloRetryRequest with the negotiated hash. The sessions are shared by
+ * all the threads and OpenSSL takes ownership of the resumed session, so
+ * give it a copy.
+ */
+static int
+psk_use_session_cb(SSL *tls, const EVP_MD *md, const unsigned char **id,
+		   size_t *idlen, SSL_SESSION **sess)
+{
+	auto sh = (SocketHandler *)SSL_get_app_data(tls);
+	auto &p = g_psk.ent[sh->hs.psk];
+	auto ciph = SSL_SESSION_get0_cipher(p.sess);
+
+	*sess = NULL;
+	if (md && EVP_MD_type(md)
+		  != EVP_MD_type(SSL_CIPHER_get_handshake_digest(ciph)))
+		return 1;
+	if (!(*sess = SSL_SESSION_dup(p.sess)))
+		return 0;
+	*id = (const unsigned char *)p.identity.data();
+	*idlen = p.identity.size();
+	return 1;
+}
+
+static int
+psk_set(SSL *tls)
+{
+	int i = g_psk.next++ % g_psk.ent.size();
+
+	SSL_set_psk_use_session_callback(tls, psk_use_session_cb);
+	return i;
+}
+
+/**
+ * Server names with optional ALPN lists. All the strings live in one
+ * buffer, so even millions of names take little memory and don't fragment
+ * the heap: names are zero terminated for SSL_set_tlsext_host_name() and
+ * ALPN lists are in the wire format.
+ */
+struct SniEntry {
+	uint32_t	name;
+	uint32_t	alpn;
+	uint16_t	alpn_len;
+	uint32_t	group;
+};
+
+enum {
+	SNI_UNIFORM,
+	SNI_ZIPF,
+	SNI_SEQ,
+};
+
+static struct {
+	std::string		buf;
+	std::vector<SniEntry>	ent;
+	std::vector<std::string> groups;
+	// Zipf cumulative distribution over the entries in the file order.
+	std::vector<double>	cdf;
+	std::atomic<uint64_t>	next;
+	bool			alpn;
+} g_sni;
+
+/**
+ * Parse the SNI file lines in the form
+ *	<host name> [<alpn>[,<alpn>...] | -] [<vhost group>]
+ * The vhost group defaults to the parent domain of the host name.
+ */
+static int
+sni_load(const char *path) noexcept
+{
+	std::ifstream f(path);
+	std::map<std::string, uint32_t> groups;
+	std::string line;
+
+	if (!f) {
+		std::cerr << "ERROR: cannot open SNI file '" << path << "'"
+			  << std::endl;
+		return -ENOENT;
+	}
+	while (std::getline(f, line)) {
+		auto c = line.find('#');
+		if (c != std::string::npos)
+			line.resize(c);
+
+		std::istringstream ss(line);
+		std::string name, alpn, group;
+		if (!(ss >> name))
+			continue;
+		ss >> alpn >> group;
+		if (group.empty()) {
+			auto dot = name.find('.');
+			group = dot == std::string::npos ? name
+							 : name.substr(dot + 1);
+		}
+
+		SniEntry e = {};
+		e.name = g_sni.buf.size();
+		g_sni.buf.append(name).push_back('\0');
+		e.alpn = g_sni.buf.size();
+		if (!alpn.empty() && alpn != "-") {
+			std::string wire;
+			if (!alpn_wire(alpn, wire)) {
+				std::cerr << "ERROR: bad ALPN '" << alpn
+					  << "' in SNI file" << std::endl;
+				return -EINVAL;
+			}
+			g_sni.buf.append(wire);
+			e.alpn_len = wire.size();
+			g_sni.alpn = true;
+		}
+		auto g = groups.emplace(group, g_sni.groups.size());
+		if (g.second)
+			g_sni.groups.push_back(group);
+		e.group = g.first->second;
+		g_sni.ent.push_back(e);
+	}
+	if (g_sni.ent.empty()) {
+		std::cerr << "ERROR: no server names in SNI file '" << path
+			  << "'" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.sni_dist == SNI_ZIPF) {
+		double sum = 0;
+		g_sni.cdf.reserve(g_sni.ent.size());
+		for (size_t i = 1; i <= g_sni.ent.size(); ++i) {
+			sum += 1 / std::pow((double)i, g_opt.sni_zipf_s);
+			g_sni.cdf.push_back(sum);
+		}
+		for (auto &p : g_sni.cdf)
+			p /= sum;
+	}
+	return 0;
+}
+
+/**
+ * Draw a server name for the handshake and return the entry index.
+ */
+static int
+sni_set(SSL *tls)
+{
+	size_t i;
+
+	switch (g_opt.sni_dist) {
+	case SNI_SEQ:
+		i = g_sni.next++ % g_sni.ent.size();
+		break;
+	case SNI_ZIPF:
+	{
+		std::uniform_real_distribution<double> u(0, 1);
+		i = std::lower_bound(g_sni.cdf.begin(), g_sni.cdf.end(),
+				     u(rng)) - g_sni.cdf.begin();
+		i = std::min(i, g_sni.ent.size() - 1);
+		break;
+	}
+	default:
+		i = rng() % g_sni.ent.size();
+	}
+
+	auto &e = g_sni.ent[i];
+	const char *name = g_sni.buf.data() + e.name;
+	if (!SSL_set_tlsext_host_name(tls, name))
+		throw Except("cannot set SNI");
+	if (e.alpn_len
+	    && SSL_set_alpn_protos(tls, (const unsigned char *)
+					g_sni.buf.data() + e.alpn, e.alpn_len))
+		throw Except("cannot set ALPN");
+	return i;
+}
+
+/**
+ * Load CA certificates from a PEM file or a hashed directory, 'system' stands
+ * for the OpenSSL default locations.
+ */
+static int
+verify_store_load(const char *path) noexcept
+{
+	g_verify.store = X509_STORE_new();
+	if (!g_verify.store)
+		return -ENOMEM;
+
+	int r;
+	if (!strcmp(path, "system")) {
+		r = X509_STORE_set_default_paths(g_verify.store);
+	}
+	else if (DIR *d = opendir(path)) {
+		closedir(d);
+		auto l = X509_STORE_add_lookup(g_verify.store,
+					       X509_LOOKUP_hash_dir());
+		r = l && X509_LOOKUP_add_dir(l, path, X509_FILETYPE_PEM);
+	}
+	else {
+		auto l = X509_STORE_add_lookup(g_verify.store,
+					       X509_LOOKUP_file());
+		r = l && X509_LOOKUP_load_file(l, path, X509_FILETYPE_PEM);
+	}
+	if (!r) {
+		std::cerr << "ERROR: cannot load CA certificates from '"
+			  << path << "'" << std::endl;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+class IO {
+private:
+	static const size_t N_EVENTS = 128;
+	static const size_t TO_MSEC = 5;
+
+private:
+	int			ed_;
+	int			ev_count_;
+	SSL_CTX			*tls_ctx_;
+	std::vector<SSL_CTX *>	mix_ctx_;
+	struct epoll_event	events_[N_EVENTS];
+	std::list<SocketHandler *> reconnect_q_;
+	std::list<SocketHandler *> backlog_;
+
+	typedef std::chrono::time_point<std::chrono::steady_clock> __time_t;
+	typedef std::tuple<__time_t, uint64_t, SocketHandler *> Timer;
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>>
+				timers_;
+	uint64_t		timer_seq_;
+
+public:
+	IO(int thr)
+		: ed_(-1), ev_count_(0), tls_ctx_(NULL), timer_seq_(0)
+	{
+		tls_ctx_ = tls_ctx_get(thr, g_opt);
+		for (auto &c : g_mix.cls)
+			mix_ctx_.push_back(tls_ctx_get(thr, c.opt));
+
+		if ((ed_ = epoll_create(1)) < 0)
+			throw Except("can't create epoll");
+		memset(events_, 0, sizeof(events_));
+	}
+
+	~IO()
+	{
+		if (ed_ > -1)
+			close(ed_);
+		reconnect_q_.clear();
+	}
+
+	void
+	add(SocketHandler *sh)
+	{
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLOUT | EPOLLERR,
+			.data = { .ptr = sh }
+		};
+
+		if (epoll_ctl(ed_, EPOLL_CTL_ADD, sh->sd, &ev) < 0)
+			throw Except("can't add socket to poller");
+	}
+
+	void
+	mod(SocketHandler *sh, uint32_t events)
+	{
+		struct epoll_event ev = {
+			.events = events,
+			.data = { .ptr = sh }
+		};
+
+		if (epoll_ctl(ed_, EPOLL_CTL_MOD, sh->sd, &ev) < 0)
+			throw Except("can't modify socket events in poller");
+	}
+
+	void
+	del(SocketHandler *sh)
+	{
+		if (epoll_ctl(ed_, EPOLL_CTL_DEL, sh->sd, NULL) < 0)
+			throw Except("can't delete socket from poller");
+	}
+
+	void
+	queue_reconnect(SocketHandler *sh) noexcept
+	{
+		reconnect_q_.push_back(sh);
+	}
+
+	void
 	wait()
 	{
 	retry:
@@ -368,23 +2295,106 @@ public:
 		return sh;
 	}
 
+	/**
+	 * Call next_state() for the socket handler in @msec milliseconds.
+	 * The timers have resolution of the poller timeout, TO_MSEC.
+	 * A socket handler can have only one timer, a new timer replaces
+	 * the previous one.
+	 */
+	void
+	add_timer(SocketHandler *sh, unsigned long msec)
+	{
+		auto t = std::chrono::steady_clock::now()
+			 + std::chrono::milliseconds(msec);
+		sh->timer = ++timer_seq_;
+		timers_.push(Timer(t, sh->timer, sh));
+	}
+
+	/**
+	 * Removing from the priority queue is expensive, so just forget the
+	 * timer and skip it on expiration.
+	 */
+	void
+	del_timer(SocketHandler *sh) noexcept
+	{
+		sh->timer = 0;
+	}
+
+	SocketHandler *
+	next_timer() noexcept
+	{
+		while (!timers_.empty()) {
+			auto &t = timers_.top();
+			if (std::get<0>(t) > std::chrono::steady_clock::now())
+				return NULL;
+
+			SocketHandler *sh = std::get<2>(t);
+			bool active = sh->timer == std::get<1>(t);
+			timers_.pop();
+			if (active) {
+				sh->timer = 0;
+				return sh;
+			}
+		}
+		return NULL;
+	}
+
 	SSL *
 	new_tls_ctx(SocketHandler *sh)
 	{
-		SSL *ctx = SSL_new(tls_ctx_);
+		SSL_CTX *tls_ctx = tls_ctx_;
+		if (!mix_ctx_.empty()) {
+			sh->hs.mix = mix_pick();
+			tls_ctx = mix_ctx_[sh->hs.mix];
+		}
+
+		SSL *ctx = SSL_new(tls_ctx);
 		if (!ctx)
 			throw Except("cannot clone TLS context");
 
 		SSL_set_fd(ctx, sh->sd);
+		SSL_set_app_data(ctx, sh);
 		BIO_set_tcp_ndelay(sh->sd, true);
-		if (g_opt.use_tickets) {
+		if (!g_client_certs.certs.empty())
+			client_cert_set(ctx);
+		if (!g_psk.ent.empty())
+			sh->hs.psk = psk_set(ctx);
+		if (!g_sni.ent.empty())
+			sh->hs.sni = sni_set(ctx);
+		else if (g_opt.verify_host)
+			SSL_set_tlsext_host_name(ctx, g_opt.verify_host);
+		if (g_opt.reject == REJECT_SNI)
+			SSL_set_tlsext_host_name(ctx, REJECT_SNI_NAME);
+		if (g_opt.use_tickets && g_opt.resume_ratio >= 0) {
+			if ((int)(rng() % 100) < g_opt.resume_ratio) {
+				auto sess = sess_pool_get();
+				if (sess) {
+					set_session(ctx, sess);
+					SSL_SESSION_free(sess);
+				}
+			}
+		}
+		else if (g_opt.use_tickets) {
 			auto sess = sh->get_session();
 			if (sess)
-				SSL_set_session(ctx, sess);
+				set_session(ctx, sess);
 		}
 
 		return ctx;
 	}
+
+private:
+	static void
+	set_session(SSL *ctx, SSL_SESSION *sess)
+	{
+		if (g_opt.reject != REJECT_TICKET) {
+			SSL_set_session(ctx, sess);
+			return;
+		}
+		auto bad = sess_corrupt(sess);
+		SSL_set_session(ctx, bad);
+		SSL_SESSION_free(bad);
+	}
 };
 
 class Peer : public SocketHandler {
@@ -393,6 +2403,13 @@ private:
 		STATE_TCP_CONNECT,
 		STATE_TCP_CONNECTING,
 		STATE_TLS_HANDSHAKING,
+		STATE_TLS_RESPONSE,
+		STATE_TLS_PHA,
+		STATE_TLS_TICKETS,
+		STATE_TLS_ESTABLISHED,
+		STATE_TLS_REKEY_WAIT,
+		STATE_TLS_REKEYING,
+		STATE_THINK,
 	};
 
 private:
@@ -401,20 +2418,39 @@ private:
 	SSL			*tls_;
 	SSL_SESSION		*sess_;
 	std::chrono::time_point<std::chrono::steady_clock> ts_;
+	std::chrono::time_point<std::chrono::steady_clock> ts_hs_;
+	std::chrono::time_point<std::chrono::steady_clock> deadline_;
+	std::chrono::time_point<std::chrono::steady_clock> ts_rekey_;
+	std::chrono::time_point<std::chrono::steady_clock> hold_end_;
 	enum _states		state_;
 	bool			polled_;
+	bool			resuming_;
+	bool			early_;
+	bool			req_sent_;
+	bool			req_done_;
+	bool			pha_done_;
+	int			tickets_;
+	const char		*rtt_class_;
 
 public:
 	Peer(IO &io, int id) noexcept
 		: io_(io), id_(id), tls_(NULL), sess_(NULL)
-		, state_(STATE_TCP_CONNECT), polled_(false)
+		, state_(STATE_TCP_CONNECT), polled_(false), resuming_(false)
+		, early_(false), req_sent_(false), req_done_(false)
+		, pha_done_(false), tickets_(0), rtt_class_(NULL)
 	{
 		sd = -1;
+		timer = 0;
 		dbg_status("created");
 	}
 
 	virtual ~Peer()
 	{
+		// rekey_hold() counts the connection as established too.
+		if (state_ == STATE_TLS_ESTABLISHED
+		    || state_ == STATE_TLS_REKEY_WAIT
+		    || state_ == STATE_TLS_REKEYING)
+			stat.tls_established--;
 		disconnect();
 		if (sess_)
 			SSL_SESSION_free(sess_);
@@ -430,6 +2466,32 @@ public:
 			return tcp_connect_try_finish();
 		case STATE_TLS_HANDSHAKING:
 			return tls_handshake();
+		case STATE_TLS_RESPONSE:
+			tls_response();
+			return false;
+		case STATE_TLS_PHA:
+			tls_read_pha();
+			return false;
+		case STATE_TLS_TICKETS:
+			tls_read_tickets();
+			return false;
+		case STATE_TLS_ESTABLISHED:
+			// The hold time is over.
+			close_established();
+			return false;
+		case STATE_TLS_REKEY_WAIT:
+			if (std::chrono::steady_clock::now() >= hold_end_)
+				close_established();
+			else
+				tls_rekey_start();
+			return false;
+		case STATE_TLS_REKEYING:
+			tls_rekey();
+			return false;
+		case STATE_THINK:
+			state_ = STATE_TCP_CONNECT;
+			io_.queue_reconnect(this);
+			return false;
 		default:
 			throw Except("bad next state %d", state_);
 		}
@@ -442,6 +2504,20 @@ public:
 		return sess_;
 	}
 
+	void
+	put_session(SSL_SESSION *sess)
+	{
+		dbg_status("got session ticket");
+		tickets_++;
+		g_tickets.received++;
+		if (g_opt.resume_ratio >= 0) {
+			sess_pool_put(sess);
+		} else {
+			SSL_SESSION_free(sess_);
+			sess_ = sess;
+		}
+	}
+
 private:
 	void
 	add_to_poll()
@@ -461,11 +2537,682 @@ private:
 		}
 	}
 
+	/**
+	 * The options of the connection: its mix class ones or the global
+	 * ones.
+	 */
+	const Opts &
+	opts() const noexcept
+	{
+		return hs.mix >= 0 ? g_mix.cls[hs.mix].opt : g_opt;
+	}
+
+	void
+	dbg_status(const char *msg) noexcept
+	{
+		if (g_opt.debug)
+			dbg << "peer " << id_ << " " << msg << std::endl;
+	}
+
+	const char *
+	resumption_class() noexcept
+	{
+		if (!SSL_session_reused(tls_))
+			return resuming_ ? "fallback to full" : "full";
+		if (SSL_version(tls_) != TLS1_3_VERSION)
+			return "resumed";
+
+		// There is no server ephemeral key on psk_ke resumption.
+		EVP_PKEY *key = NULL;
+		if (!SSL_get_peer_tmp_key(tls_, &key))
+			return "resumed psk_ke";
+		EVP_PKEY_free(key);
+		return "resumed psk_dhe_ke";
+	}
+
+	/**
+	 * OpenSSL doesn't resend rejected early data, so the request must be
+	 * sent again after the handshake.
+	 */
+	const char *
+	early_data_class() noexcept
+	{
+		switch (SSL_get_early_data_status(tls_)) {
+		case SSL_EARLY_DATA_ACCEPTED:
+			g_early.accepted++;
+			return "0-RTT accepted";
+		case SSL_EARLY_DATA_REJECTED:
+			g_early.rejected++;
+			req_sent_ = false;
+			return "0-RTT rejected";
+		default:
+			return "1-RTT";
+		}
+	}
+
+	/**
+	 * Account latency, handshake messages sizes and TCP segments with
+	 * data sent and received during the handshake for the negotiated
+	 * group: hybrid post-quantum key shares don't fit into one segment.
+	 */
+	void
+	group_update(unsigned long lat)
+	{
+		const char *name = SSL_group_to_name(tls_,
+					SSL_get_negotiated_group(tls_));
+		if (!name)
+			name = resuming_ && SSL_session_reused(tls_)
+			       ? "none (resumed)" : "unknown";
+
+		hs_class_update("GROUP", name, lat);
+		hs_class_sizes("GROUP", name, hs_sizes());
+	}
+
+	HsSizes
+	hs_sizes() noexcept
+	{
+		struct tcp_info ti = {};
+		socklen_t ti_len = sizeof(ti);
+		getsockopt(sd, IPPROTO_TCP, TCP_INFO, &ti, &ti_len);
+
+		return HsSizes {
+			hs.ch_len, hs.sh_len, hs.srv_len,
+			hs.recs_out, hs.recs_in,
+			ti.tcpi_data_segs_out, ti.tcpi_data_segs_in
+		};
+	}
+
+	/**
+	 * Account the limits on record size, which the server accepted.
+	 */
+	void
+	record_limit_update(unsigned long lat)
+	{
+		std::string name;
+
+		int mfl = SSL_SESSION_get_max_fragment_length(
+				SSL_get_session(tls_));
+		if (mfl != TLSEXT_max_fragment_length_DISABLED)
+			name = "max_fragment " + std::to_string(256 << mfl);
+		if (hs.rsl)
+			name += (name.empty() ? "" : ", ")
+				+ std::string("record_size_limit ")
+				+ std::to_string(hs.rsl);
+		if (name.empty())
+			name = "none";
+
+		hs_class_update("RECORD LIMIT", name, lat);
+		hs_class_sizes("RECORD LIMIT", name, hs_sizes());
+	}
+
+	static const char *
+	pkey_type_name(int nid) noexcept
+	{
+		switch (nid) {
+		case EVP_PKEY_RSA:
+			return "RSA";
+		case EVP_PKEY_RSA_PSS:
+			return "RSA-PSS";
+		case EVP_PKEY_EC:
+			return "ECDSA";
+		default:
+			return OBJ_nid2sn(nid);
+		}
+	}
+
+	/**
+	 * Account the signature algorithm and the key of the server, which
+	 * signed the handshake. There is no signature on resumed handshakes.
+	 */
+	void
+	sigalg_update(unsigned long lat)
+	{
+		int type, md;
+		if (!SSL_get_peer_signature_type_nid(tls_, &type)) {
+			hs_class_update("SIGALG", "none (resumed)", lat);
+			return;
+		}
+		std::string sigalg = pkey_type_name(type);
+		if (SSL_get_peer_signature_nid(tls_, &md) && md != NID_undef)
+			sigalg += std::string("+") + OBJ_nid2sn(md);
+		hs_class_update("SIGALG", sigalg, lat);
+
+		X509 *cert = SSL_get0_peer_certificate(tls_);
+		EVP_PKEY *key = cert ? X509_get0_pubkey(cert) : NULL;
+		if (!key)
+			return;
+		std::string key_type = pkey_type_name(EVP_PKEY_get_base_id(key));
+		char group[64];
+		if (EVP_PKEY_get_group_name(key, group, sizeof(group), NULL))
+			key_type += std::string(" ") + group;
+		else if (EVP_PKEY_get_base_id(key) == EVP_PKEY_RSA)
+			key_type += " " + std::to_string(EVP_PKEY_get_bits(key));
+		hs_class_update("SERVER KEY", key_type, lat);
+	}
+
+	/**
+	 * Servers don't staple OCSP responses on resumed handshakes, so
+	 * account them separately to not mix them with missing staples.
+	 */
+	void
+	ocsp_update(unsigned long lat)
+	{
+		const unsigned char *resp;
+		long len = SSL_get_tlsext_status_ocsp_resp(tls_, &resp);
+
+		if (len > 0) {
+			hs_class_update("OCSP", "stapled", lat);
+			g_ocsp.stapled++;
+			g_ocsp.bytes += len;
+			for (auto m = g_ocsp.max.load(); (uint64_t)len > m; )
+				if (g_ocsp.max.compare_exchange_weak(m, len))
+					break;
+		}
+		else if (SSL_session_reused(tls_)) {
+			hs_class_update("OCSP", "resumed", lat);
+		}
+		else {
+			hs_class_update("OCSP", "not stapled", lat);
+		}
+	}
+
+	void
+	sni_update(unsigned long lat)
+	{
+		auto &e = g_sni.ent[hs.sni];
+		hs_class_update("VHOST GROUP", g_sni.groups[e.group], lat);
+
+		if (!g_sni.alpn)
+			return;
+		const unsigned char *p;
+		unsigned int len;
+		SSL_get0_alpn_selected(tls_, &p, &len);
+		hs_class_update("ALPN", len ? std::string((const char *)p, len)
+					    : std::string("none"), lat);
+	}
+
+	void
+	cert_comp_update(unsigned long lat)
+	{
+		const char *name = hs.cert_comp < N_CERT_COMP_ALGS
+				   ? cert_comp_algs[hs.cert_comp] : "unknown";
+
+		hs_class_update("CERT COMPRESSION", name, lat);
+		hs_class_sizes("CERT COMPRESSION", name, hs_sizes());
+		g_cert_comp.bytes += hs.cert_len;
+		g_cert_comp.raw_bytes += hs.cert_raw_len;
+	}
+
+	std::string
+	key_exchange_class()
+	{
+		std::string c = std::to_string(hs.key_shares)
+				+ (hs.key_shares == 1 ? " key share"
+						      : " key shares");
+		if (hs.hrr)
+			c += ", HRR";
+		return c;
+	}
+
+	void
+	hs_classes_update(unsigned long lat)
+	{
+		if (hs.mix >= 0)
+			hs_class_update("MIX", g_mix.cls[hs.mix].name, lat);
+		if (g_opt.client_certs)
+			hs_class_update("CLIENT AUTH", hs.cert_req
+					? "certificate requested"
+					: "not requested", lat);
+		auto &o = opts();
+		if (o.use_tickets)
+			hs_class_update("RESUMPTION", resumption_class(), lat);
+		if ((o.curve || o.key_share)
+		    && SSL_version(tls_) == TLS1_3_VERSION)
+			hs_class_update("KEY EXCHANGE", key_exchange_class(),
+					lat);
+		if (o.curve || o.key_share)
+			group_update(lat);
+		if (o.cert_comp && hs.cert_len)
+			cert_comp_update(lat);
+		if (hs.sni >= 0)
+			sni_update(lat);
+		if (o.ocsp)
+			ocsp_update(lat);
+		if (g_verify.store && hs.mix >= 0)
+			hs_class_update("VERIFY", o.verify ? "verified"
+					: "not verified", lat);
+		if (o.sigalgs)
+			sigalg_update(lat);
+		if (o.max_frag || o.record_limit)
+			record_limit_update(lat);
+		if (hs.psk >= 0)
+			hs_class_update("EXTERNAL PSK", !SSL_session_reused(tls_)
+					? "not accepted"
+					: hs.sh_key_share ? "psk_dhe_ke"
+							  : "psk_ke", lat);
+		if (g_opt.reject)
+			hs_class_update("REJECT", g_opt.reject != REJECT_TICKET
+					? "accepted"
+					: SSL_session_reused(tls_)
+					? "resumed" : "full handshake", lat);
+	}
+
+	/**
+	 * Reconnect immediately or after a think time, like real clients do.
+	 */
+	void
+	reconnect()
+	{
+		if (g_opt.think.type == Dist::NONE) {
+			io_.queue_reconnect(this);
+			return;
+		}
+		state_ = STATE_THINK;
+		io_.add_timer(this, g_opt.think.sample());
+	}
+
+	/**
+	 * The handshake is done and we have all the data we need from the
+	 * connection: keep it open for the hold time or close it.
+	 */
+	void
+	established()
+	{
+		if (g_opt.rekey.type != Dist::NONE) {
+			rekey_hold();
+			return;
+		}
+		if (g_opt.hold.type != Dist::NONE) {
+			hold();
+			return;
+		}
+		disconnect();
+		stat.tcp_connections--;
+		reconnect();
+	}
+
+	bool
+	need_tickets() noexcept
+	{
+		return opts().use_tickets && tickets_ < g_opt.tickets_wait
+		       && SSL_version(tls_) == TLS1_3_VERSION;
+	}
+
+	/**
+	 * Go through the steps after the handshake: get the response to
+	 * the request, pass post-handshake authentication and get session
+	 * tickets. Each step reads the connection, so the next steps may be
+	 * already done on the previous ones.
+	 */
+	void
+	post_handshake()
+	{
+		if (!req_done_ && !g_opt.request.empty())
+			tls_send_request();
+		else if (g_opt.pha && !pha_done_ && !pha_check())
+			tls_wait_pha();
+		else if (need_tickets() && g_opt.tickets_wait)
+			tls_wait_tickets();
+		else
+			established();
+	}
+
+	/**
+	 * Account post-handshake authentication once the client answered
+	 * to CertificateRequest. The latency is from the handshake end, since
+	 * the server decides when to request the certificate.
+	 */
+	bool
+	pha_check()
+	{
+		using namespace std::chrono;
+
+		if (hs.pha != HsInfo::PHA_ANSWERED)
+			return false;
+		auto lat = duration_cast<milliseconds>(steady_clock::now()
+						       - ts_hs_).count();
+		if (start_stats)
+			hs_class_update("POST-HANDSHAKE AUTH", "answered", lat);
+		dbg_status("answered post-handshake authentication");
+		pha_done_ = true;
+		return true;
+	}
+
+	void
+	tls_wait_pha()
+	{
+		state_ = STATE_TLS_PHA;
+		deadline_ = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(g_opt.pha_to);
+		add_to_poll();
+		io_.mod(this, EPOLLIN | EPOLLERR);
+		io_.add_timer(this, g_opt.pha_to);
+		tls_read_pha();
+	}
+
+	void
+	tls_read_pha()
+	{
+		char buf[256];
+
+		while (!pha_check()) {
+			int r = SSL_read(tls_, buf, sizeof(buf));
+			if (r > 0)
+				continue;
+			int e = SSL_get_error(tls_, r);
+			switch (e) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				if (pha_check())
+					break;
+				if (std::chrono::steady_clock::now()
+				    < deadline_)
+				{
+					// The client certificate chain may
+					// not fit into the socket buffer.
+					io_.mod(this, e == SSL_ERROR_WANT_WRITE
+						      ? EPOLLOUT | EPOLLERR
+						      : EPOLLIN | EPOLLERR);
+					return;
+				}
+				dbg_status("timed out on post-handshake"
+					   " authentication");
+				g_pha.timeouts++;
+				break;
+			default:
+				dbg_status("failed post-handshake"
+					   " authentication");
+				ERR_clear_error();
+				g_pha.failed++;
+			}
+			break;
+		}
+
+		pha_done_ = true;
+		io_.del_timer(this);
+		post_handshake();
+	}
+
+	/**
+	 * Send the request, unless it was already sent as early data, and
+	 * wait for the first byte of the response.
+	 */
+	void
+	tls_send_request()
+	{
+		state_ = STATE_TLS_RESPONSE;
+		deadline_ = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(RESPONSE_TO_MSEC);
+		add_to_poll();
+		io_.mod(this, req_sent_ ? EPOLLIN | EPOLLERR
+					: EPOLLIN | EPOLLOUT | EPOLLERR);
+		io_.add_timer(this, RESPONSE_TO_MSEC);
+		tls_response();
+	}
+
+	void
+	tls_response()
+	{
+		using namespace std::chrono;
+
+		char buf[256];
+		int r;
+
+		if (!req_sent_) {
+			size_t n;
+			r = SSL_write_ex(tls_, g_opt.request.data(),
+					 g_opt.request.size(), &n);
+			if (r != 1)
+				goto err;
+			req_sent_ = true;
+			io_.mod(this, EPOLLIN | EPOLLERR);
+		}
+
+		r = SSL_read(tls_, buf, sizeof(buf));
+		if (r > 0) {
+			auto t1(steady_clock::now());
+			auto lat = duration_cast<milliseconds>(t1 - ts_).count();
+			if (start_stats)
+				hs_class_update("FIRST BYTE", rtt_class_, lat);
+			dbg_status("got response");
+			io_.del_timer(this);
+			req_done_ = true;
+			post_handshake();
+			return;
+		}
+	err:
+		switch (SSL_get_error(tls_, r)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			if (steady_clock::now() < deadline_)
+				return;
+			dbg_status("timed out on response");
+			break;
+		default:
+			dbg_status("failed to get response");
+			ERR_clear_error();
+		}
+		g_early.resp_errors++;
+		stat.error_count++;
+		io_.del_timer(this);
+		disconnect();
+		stat.tcp_connections--;
+		reconnect();
+	}
+
+	/**
+	 * TLS 1.3 servers send session tickets after the handshake, so read
+	 * the connection until we get the required number of tickets or the
+	 * waiting time is over. Poll only for reading to not spin on always
+	 * writable socket.
+	 */
+	void
+	tls_wait_tickets()
+	{
+		state_ = STATE_TLS_TICKETS;
+		deadline_ = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(g_opt.tickets_to);
+		add_to_poll();
+		io_.mod(this, EPOLLIN | EPOLLERR);
+		io_.add_timer(this, g_opt.tickets_to);
+		tls_read_tickets();
+	}
+
+	void
+	tls_read_tickets()
+	{
+		char buf[256];
+
+		while (tickets_ < g_opt.tickets_wait) {
+			int r = SSL_read(tls_, buf, sizeof(buf));
+			if (r > 0)
+				continue;
+			switch (SSL_get_error(tls_, r)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				// SSL_read() processes the tickets and then
+				// wants more data.
+				if (tickets_ >= g_opt.tickets_wait)
+					break;
+				if (std::chrono::steady_clock::now()
+				    < deadline_)
+					return;
+				dbg_status("timed out on session tickets");
+				g_tickets.timeouts++;
+				break;
+			default:
+				// The server closed the connection, probably
+				// right after the tickets, so check them below.
+				ERR_clear_error();
+				if (tickets_ < g_opt.tickets_wait)
+					g_tickets.closed++;
+			}
+			break;
+		}
+
+		io_.del_timer(this);
+		established();
+	}
+
+	/**
+	 * Keep the established connection for the hold time. We don't read
+	 * or write on the connection, so don't poll the socket.
+	 */
+	void
+	hold()
+	{
+		del_from_poll();
+		state_ = STATE_TLS_ESTABLISHED;
+		stat.tls_established++;
+		io_.add_timer(this, g_opt.hold.sample());
+	}
+
+	void
+	close_established()
+	{
+		dbg_status("closes established TLS connection");
+		stat.tls_established--;
+		disconnect();
+		stat.tcp_connections--;
+		reconnect();
+	}
+
+	/**
+	 * Keep the established connection open for the hold time, or until
+	 * the end of the run without a hold time, and update the keys after
+	 * each rekey interval.
+	 */
+	void
+	rekey_hold()
+	{
+		using namespace std::chrono;
+
+		stat.tls_established++;
+		hold_end_ = g_opt.hold.type == Dist::NONE
+			    ? steady_clock::time_point::max()
+			    : steady_clock::now()
+			      + milliseconds(g_opt.hold.sample());
+		rekey_wait();
+	}
+
+	void
+	rekey_wait()
+	{
+		using namespace std::chrono;
+
+		auto left = duration_cast<milliseconds>(hold_end_
+							- steady_clock::now());
+		del_from_poll();
+		state_ = STATE_TLS_REKEY_WAIT;
+		io_.add_timer(this, std::min<unsigned long>(g_opt.rekey.sample(),
+							    std::max(left.count(),
+								     0L)));
+	}
+
+	/**
+	 * Send TLS 1.3 KeyUpdate requesting the server to update its keys
+	 * too, or start TLS 1.2 renegotiation.
+	 */
+	void
+	tls_rekey_start()
+	{
+		using namespace std::chrono;
+
+		state_ = STATE_TLS_REKEYING;
+		hs.key_update = false;
+		hs.alert = -1;
+		req_sent_ = g_opt.request.empty();
+		ts_rekey_ = steady_clock::now();
+		deadline_ = ts_rekey_ + milliseconds(RESPONSE_TO_MSEC);
+
+		int r = SSL_version(tls_) == TLS1_3_VERSION
+			? SSL_key_update(tls_, SSL_KEY_UPDATE_REQUESTED)
+			: SSL_renegotiate(tls_);
+		if (r != 1) {
+			dbg_status("cannot start rekey");
+			ERR_clear_error();
+			rekey_failed(g_rekey.failed);
+			return;
+		}
+		add_to_poll();
+		io_.mod(this, EPOLLIN | EPOLLERR);
+		io_.add_timer(this, RESPONSE_TO_MSEC);
+		tls_rekey();
+	}
+
+	/**
+	 * Send our KeyUpdate or drive the renegotiation handshake to the end.
+	 * Servers may send their KeyUpdate only before the next application
+	 * data, so we wait for it only if we have a request to send.
+	 */
+	void
+	tls_rekey()
+	{
+		using namespace std::chrono;
+
+		char buf[256];
+		bool tls13 = SSL_version(tls_) == TLS1_3_VERSION;
+		bool wait = tls13 && !g_opt.request.empty();
+
+		int r = SSL_do_handshake(tls_);
+		if (r == 1 && !req_sent_) {
+			size_t n;
+			r = SSL_write_ex(tls_, g_opt.request.data(),
+					 g_opt.request.size(), &n);
+			req_sent_ = r == 1;
+		}
+		if (r == 1 && wait)
+			while (!hs.key_update
+			       && (r = SSL_read(tls_, buf, sizeof(buf))) > 0)
+				;
+		if (r <= 0) {
+			int e = SSL_get_error(tls_, r);
+			switch (e) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				if (wait && hs.key_update)
+					break;
+				if (steady_clock::now() < deadline_) {
+					io_.mod(this, e == SSL_ERROR_WANT_WRITE
+						      ? EPOLLOUT | EPOLLERR
+						      : EPOLLIN | EPOLLERR);
+					return;
+				}
+				dbg_status("timed out on rekey");
+				rekey_failed(g_rekey.timeouts);
+				return;
+			default:
+				dbg_status("failed to rekey");
+				ERR_clear_error();
+				rekey_failed(hs.alert == SSL_AD_NO_RENEGOTIATION
+					     ? g_rekey.refused
+					     : g_rekey.failed);
+				return;
+			}
+		}
+		if (!tls13 && SSL_renegotiate_pending(tls_))
+			return;
+
+		auto lat = duration_cast<milliseconds>(steady_clock::now()
+						       - ts_rekey_).count();
+		// Sending our KeyUpdate only is local, so there is no latency.
+		if (start_stats && tls13 && !wait)
+			hs_class_count("REKEY", "key update sent");
+		else if (start_stats)
+			hs_class_update("REKEY", tls13 ? "key update"
+						       : "renegotiation", lat);
+		dbg_status("updated keys");
+		io_.del_timer(this);
+		rekey_wait();
+	}
+
 	void
-	dbg_status(const char *msg) noexcept
+	rekey_failed(std::atomic<uint64_t> &counter)
 	{
-		if (g_opt.debug)
-			dbg << "peer " << id_ << " " << msg << std::endl;
+		counter++;
+		stat.error_count++;
+		io_.del_timer(this);
+		close_established();
 	}
 
 	bool
@@ -476,24 +3223,56 @@ private:
 		state_ = STATE_TLS_HANDSHAKING;
 
 		if (!tls_) {
+			hs.reset();
 			tls_ = io_.new_tls_ctx(this);
+			resuming_ = SSL_get_session(tls_);
+			tickets_ = 0;
+			req_sent_ = false;
+			req_done_ = false;
+			pha_done_ = false;
+			early_ = g_opt.early_data && resuming_
+				 && SSL_SESSION_get_max_early_data(
+					SSL_get_session(tls_))
+				    >= g_opt.request.size();
 			stat.tls_handshakes++;
 			ts_ = steady_clock::now();
 		}
 
-		int r = SSL_connect(tls_);
+		int r;
+		if (early_) {
+			// Send the request in the first flight along with
+			// ClientHello and finish the handshake then.
+			size_t n;
+			r = SSL_write_early_data(tls_, g_opt.request.data(),
+						 g_opt.request.size(), &n);
+			if (r == 1) {
+				early_ = false;
+				req_sent_ = true;
+				g_early.sent++;
+				r = SSL_connect(tls_);
+			}
+		} else {
+			r = SSL_connect(tls_);
+		}
 		if (r == 1) {
 			auto t1(steady_clock::now());
 			auto lat = duration_cast<milliseconds>(t1 - ts_).count();
 			lat_stat.update(lat);
+			if (g_opt.lat_target)
+				lat_hist.update(lat);
+			if (start_stats)
+				hs_classes_update(lat);
 
 			dbg_status("has completed TLS handshake");
 			stat.tls_handshakes--;
 			stat.tls_connections++;
 			stat.tot_tls_handshakes++;
-			disconnect();
-			stat.tcp_connections--;
-			io_.queue_reconnect(this);
+			if (SSL_session_reused(tls_))
+				stat.tls_resumed++;
+			ts_hs_ = t1;
+			if (!g_opt.request.empty())
+				rtt_class_ = early_data_class();
+			post_handshake();
 			return true;
 		}
 
@@ -503,17 +3282,58 @@ private:
 			add_to_poll();
 			break;
 		default:
-			if (!stat.tot_tls_handshakes)
+			if (g_opt.reject && hs.alert >= 0) {
+				rejected();
+				break;
+			}
+			if (!g_opt.reject && !stat.tot_tls_handshakes)
 				throw Except("cannot establish even one TLS"
 					     " connection");
+			ERR_clear_error();
 			stat.tls_handshakes--;
 			stat.error_count++;
 			disconnect();
 			stat.tcp_connections--;
+			// A burst waits for all its peers whatever the
+			// handshake result is, and rejection benchmarks go on
+			// on transport errors.
+			if (g_opt.reject)
+				reconnect();
+			else if (g_opt.burst_period)
+				io_.queue_reconnect(this);
 		}
 		return false;
 	}
 
+	/**
+	 * The server has rejected the handshake with an alert as we asked for:
+	 * account it as a handshake with the time to the alert as the latency.
+	 */
+	void
+	rejected()
+	{
+		using namespace std::chrono;
+
+		auto lat = duration_cast<milliseconds>(steady_clock::now() - ts_)
+			   .count();
+		lat_stat.update(lat);
+		if (g_opt.lat_target)
+			lat_hist.update(lat);
+		if (start_stats)
+			hs_class_update("REJECT",
+					SSL_alert_desc_string_long(hs.alert),
+					lat);
+
+		dbg_status("has been rejected");
+		ERR_clear_error();
+		stat.tls_handshakes--;
+		stat.tls_connections++;
+		stat.tot_tls_handshakes++;
+		disconnect();
+		stat.tcp_connections--;
+		reconnect();
+	}
+
 	bool
 	handle_established_tcp_conn()
 	{
@@ -535,12 +3355,20 @@ private:
 			return;
 		}
 
-		if (!stat.tcp_connections)
+		// Each burst starts without connections, so a refused connect
+		// there is a listen backlog overflow rather than a dead server.
+		if (!stat.tcp_connections && !g_opt.burst_period)
 			throw Except("cannot establish even one TCP connection");
 
 		errno = 0;
 		stat.tcp_handshakes--;
 		disconnect();
+		// Failed connects, e.g. on listen backlog overflow, are
+		// essential for bursts.
+		if (g_opt.burst_period) {
+			stat.error_count++;
+			io_.queue_reconnect(this);
+		}
 	}
 
 	bool
@@ -593,7 +3421,20 @@ private:
 			// the session if resumed sessions are unwanted.
 			// Even SSL_CTX_set_session_cache_mode() doesn't help to
 			// restrict session cache usage.
-			if (g_opt.use_tickets) {
+			// TLS 1.3 sessions come with tickets through
+			// new_session_cb().
+			if (g_opt.use_tickets
+			    && SSL_version(tls_) == TLS1_3_VERSION) {
+				SSL_shutdown(tls_);
+			}
+			else if (g_opt.use_tickets && g_opt.resume_ratio >= 0) {
+				// Pool sessions are single use, so don't return
+				// the resumed ones.
+				SSL_shutdown(tls_);
+				if (!SSL_session_reused(tls_))
+					sess_pool_put(SSL_get1_session(tls_));
+			}
+			else if (g_opt.use_tickets) {
 				auto old_sess = sess_;
 				SSL_shutdown(tls_);
 				sess_ = SSL_get1_session(tls_);
@@ -602,6 +3443,7 @@ private:
 			SSL_free(tls_);
 			tls_ = NULL;
 		}
+		io_.del_timer(this);
 		if (sd >= 0) {
 			try {
 				del_from_poll();
@@ -649,14 +3491,149 @@ usage() noexcept
 					   " algorithms (use\n"
 		<< "                       `openssl ecparam -list_curves`"
 					   " to list available curves).\n"
+		<< "  --key-share <groups> Send key shares only for the groups from"
+					   " the colon separated\n"
+		<< "                       list and just offer the rest of -C"
+					   " groups, e.g. to force\n"
+		<< "                       HelloRetryRequest\n"
+		<< "  --cert-comp <algs>   Advertise TLS 1.3 certificate compression"
+					   " algorithms from\n"
+		<< "                       the colon separated list of 'zlib',"
+					   " 'brotli' and 'zstd',\n"
+		<< "                       or 'none' (requires OpenSSL 3.2)\n"
+		<< "  --sigalgs <list>     Offer the signature algorithms from the"
+					   " colon separated\n"
+		<< "                       list, e.g. 'ECDSA+SHA256:rsa_pss_rsae_sha256',"
+					   " and report\n"
+		<< "                       negotiated algorithms and server keys,"
+					   " 'any' to only report\n"
+		<< "  --max-frag <N>       Negotiate maximum fragment length <N>:"
+					   " 512, 1024, 2048\n"
+		<< "                       or 4096\n"
+		<< "  --record-limit <N>   Send record_size_limit <N>, from 64 to"
+					   " 16385\n"
+		<< "  --alpn <list>        Offer the comma separated ALPN protocols\n"
+		<< "  --grease             Send GREASE extensions like browsers do\n"
+		<< "  --padding            Send the padding extension, which pads"
+					   " ClientHello of\n"
+		<< "                       256 to 511 bytes to 512 bytes\n"
+		<< "  --profile <list>     Mimic ClientHello of browsers and"
+					   " libraries, the comma\n"
+		<< "                       separated list of <profile>[:<weight>]"
+					   " is a connection mix\n"
+		<< "                       of the profiles: 'chrome', 'firefox',"
+					   " 'safari', 'curl'\n"
+		<< "                       and the profiles from --profiles file\n"
+		<< "  --profiles <file>    Load more profiles, each line of the file"
+					   " is a profile name\n"
+		<< "                       and TLS options\n"
 		<< "  -V,--tls <version>   Set TLS version for handshake:\n"
 		<< "                       '1.2', '1.3' or 'any' for both (default: '1.2')\n"
 		<< "  -K,--tickets <mode>  Process TLS Session tickets and session"
 					   " resumption,\n"
 		<< "                       'on', 'off' or 'advertise', "
 		<< "(default: 'off')\n"
-		<< "  -F,--keylogfile <f>  File to dump keys for traffic analysers"
-		<< "\n\n"
+		<< "  --resume <mode>      Resume sessions with TLS 1.2 session IDs or"
+					   " tickets or\n"
+		<< "                       TLS 1.3 PSK: 'id', 'ticket', 'psk_dhe_ke'"
+					   " or 'psk_ke'\n"
+		<< "                       (also offer psk_ke, the server picks"
+					   " the mode)\n"
+		<< "  --resume-ratio <p>   Resume <p> percents of handshakes with"
+					   " single use sessions\n"
+		<< "                       from the pool shared by all the threads\n"
+		<< "  --reject <mode>      Make handshakes the server must reject and"
+					   " report alerts:\n"
+		<< "                       'version', 'cipher', 'group', 'sni' or"
+					   " 'ticket'\n"
+		<< "  --tickets-wait <N>   Wait for <N> TLS 1.3 session tickets after"
+					   " handshake (default: 1)\n"
+		<< "  --tickets-to <ms>    Maximum time to wait for the tickets"
+		<< " (default: " << TICKETS_WAIT_MSEC << ")\n"
+		<< "  --request <file>     Send the request from the file after"
+					   " handshake and measure\n"
+		<< "                       time to the first byte of the response\n"
+		<< "  --early-data         Send the request as TLS 1.3 0-RTT early"
+					   " data on resumed\n"
+		<< "                       sessions (default request: HTTP GET /)\n"
+		<< "  --sess-pool <N>      Maximum number of sessions in the pool"
+		<< " (default: " << SESS_POOL_MAX << ")\n"
+		<< "  --sess-load <file>   Preload the session pool from the file\n"
+		<< "  --sess-save <file>   Save the session pool to the file at"
+					   " exit\n"
+		<< "  --client-certs <p>   Present client certificates with keys"
+					   " from PEM bundle\n"
+		<< "                       or directory <p> in round-robin"
+					   " order\n"
+		<< "  --client-cert-random Choose the client certificates"
+					   " randomly\n"
+		<< "  --psk <file>         Offer TLS 1.3 external PSKs from the file"
+					   " in round-robin\n"
+		<< "                       order, each line is an identity, a hex"
+					   " key and an optional\n"
+		<< "                       cipher\n"
+		<< "  --psk-mode <mode>    PSK key exchange modes to offer:"
+					   " 'psk_dhe_ke' (default) or\n"
+		<< "                       'psk_ke' to also offer psk_ke, the"
+					   " server picks the mode\n"
+		<< "  --post-handshake-auth Offer TLS 1.3 post-handshake client"
+					   " authentication and\n"
+		<< "                       wait until the server requests the"
+					   " client certificate\n"
+		<< "  --pha-to <ms>        Maximum time to wait for the certificate"
+					   " request\n"
+		<< "                       (default: " << RESPONSE_TO_MSEC << ")\n"
+		<< "  --sni <file>         Send SNI and ALPN drawn from the file"
+					   " for each handshake\n"
+		<< "  --sni-dist <dist>    Server names distribution: 'uniform',"
+					   " 'zipf[:<s>]' or 'seq'\n"
+		<< "                       (default: 'uniform', Zipf <s> is 1.0"
+					   " by default)\n"
+		<< "  --ocsp               Request OCSP stapling\n"
+		<< "  --verify <path>      Verify server certificates with CA"
+					   " certificates from PEM\n"
+		<< "                       file or hashed directory <path>,"
+					   " 'system' for OpenSSL\n"
+		<< "                       default locations\n"
+		<< "  --verify-host <name> Check the server name in the"
+					   " certificate and send it in SNI\n"
+		<< "  --no-verify          Don't verify server certificates,"
+					   " e.g. for a mix class\n"
+		<< "  -F,--keylogfile <f>  File to dump keys for traffic analysers\n"
+		<< "  --lat-target <ms>    Adjust the number of parallel connections"
+					   " for each thread\n"
+		<< "                       to keep 99th percentile of handshake"
+					   " latency at <ms>,\n"
+		<< "                       -l sets the upper limit for the number"
+					   " of connections\n"
+		<< "  --burst <ms>         Release -l connections from each thread"
+					   " at once, in the same\n"
+		<< "                       millisecond for all threads, each <ms>"
+					   " milliseconds\n"
+		<< "  --think <dist>       Think time before reconnecting\n"
+		<< "  --hold <dist>        Time to keep established TLS connection"
+					   " open\n"
+		<< "  --rekey <dist>       Keep established connections open and"
+					   " update the keys\n"
+		<< "                       (TLS 1.3 KeyUpdate or TLS 1.2"
+					   " renegotiation) after each\n"
+		<< "                       interval\n"
+		<< "                       <dist> is <ms>, fixed:<ms>, exp:<mean ms>"
+					   " or\n"
+		<< "                       lognormal:<mean ms>:<sigma>\n"
+		<< "  --scenario <file>    Run phases from the file one after"
+					   " another, each line\n"
+		<< "                       is a phase name followed by the options"
+					   " for the phase\n"
+		<< "  --mix <file>         Mix connections with different TLS"
+					   " settings, each line of\n"
+		<< "                       the file is a weight, a class name and"
+					   " TLS options\n"
+		<< "  --sweep              Run with 1, 2, 4, ... up to -t threads one"
+					   " after another\n"
+		<< "                       and report handshakes per client CPU"
+					   " core for each step\n"
+		<< "\n"
 		<< "127.0.0.1:443 address is used by default.\n"
 		<< "\n"
 		<< "To list available ciphers on a remote peer use:\n"
@@ -694,23 +3671,58 @@ parse_ipv6(const char *addr, const char *port)
 	return 0;
 }
 
+enum {
+	OPT_SWEEP = 0x100,
+	OPT_LAT_TARGET,
+	OPT_BURST,
+	OPT_THINK,
+	OPT_HOLD,
+	OPT_SCENARIO,
+	OPT_RESUME,
+	OPT_RESUME_RATIO,
+	OPT_SESS_POOL,
+	OPT_TICKETS_WAIT,
+	OPT_TICKETS_TO,
+	OPT_REQUEST,
+	OPT_EARLY_DATA,
+	OPT_KEY_SHARE,
+	OPT_CLIENT_CERTS,
+	OPT_CLIENT_CERT_RANDOM,
+	OPT_PHA,
+	OPT_PHA_TO,
+	OPT_VERIFY,
+	OPT_VERIFY_HOST,
+	OPT_NO_VERIFY,
+	OPT_CERT_COMP,
+	OPT_SNI,
+	OPT_SNI_DIST,
+	OPT_OCSP,
+	OPT_SIGALGS,
+	OPT_MAX_FRAG,
+	OPT_RECORD_LIMIT,
+	OPT_MIX,
+	OPT_ALPN,
+	OPT_GREASE,
+	OPT_PADDING,
+	OPT_PROFILE,
+	OPT_PROFILES,
+	OPT_REJECT,
+	OPT_REKEY,
+	OPT_PSK,
+	OPT_PSK_MODE,
+	OPT_SESS_LOAD,
+	OPT_SESS_SAVE,
+};
+
+/**
+ * Parse the options from the command line or from a scenario phase
+ * into g_opt.
+ */
 static int
-do_getopt(int argc, char *argv[]) noexcept
+parse_opts(int argc, char *argv[], bool phase) noexcept
 {
 	int c, o = 0;
 
-	g_opt.n_peers = DEFAULT_PEERS;
-	g_opt.n_threads = DEFAULT_THREADS;
-	g_opt.n_hs = ULONG_MAX; // infinite, in practice
-	g_opt.cipher = NULL;
-	g_opt.curve = NULL;
-	g_opt.keylogfile = NULL;
-	g_opt.debug = false;
-	g_opt.timeout = 0;
-	g_opt.tls_vers = TLS1_2_VERSION;
-	g_opt.use_tickets = false;
-	g_opt.adv_tickets = false;
-
 	static struct option long_opts[] = {
 		{"help", no_argument, NULL, 'h'},
 		{"debug", no_argument, NULL, 'd'},
@@ -719,11 +3731,52 @@ do_getopt(int argc, char *argv[]) noexcept
 		{"tls", required_argument, NULL, 'V'},
 		{"tickets", required_argument, NULL, 'K'},
 		{"keylogfile", required_argument, NULL, 'F'},
+		{"sweep", no_argument, NULL, OPT_SWEEP},
+		{"lat-target", required_argument, NULL, OPT_LAT_TARGET},
+		{"burst", required_argument, NULL, OPT_BURST},
+		{"think", required_argument, NULL, OPT_THINK},
+		{"hold", required_argument, NULL, OPT_HOLD},
+		{"scenario", required_argument, NULL, OPT_SCENARIO},
+		{"resume", required_argument, NULL, OPT_RESUME},
+		{"resume-ratio", required_argument, NULL, OPT_RESUME_RATIO},
+		{"sess-pool", required_argument, NULL, OPT_SESS_POOL},
+		{"tickets-wait", required_argument, NULL, OPT_TICKETS_WAIT},
+		{"tickets-to", required_argument, NULL, OPT_TICKETS_TO},
+		{"request", required_argument, NULL, OPT_REQUEST},
+		{"early-data", no_argument, NULL, OPT_EARLY_DATA},
+		{"key-share", required_argument, NULL, OPT_KEY_SHARE},
+		{"client-certs", required_argument, NULL, OPT_CLIENT_CERTS},
+		{"post-handshake-auth", no_argument, NULL, OPT_PHA},
+		{"pha-to", required_argument, NULL, OPT_PHA_TO},
+		{"verify", required_argument, NULL, OPT_VERIFY},
+		{"verify-host", required_argument, NULL, OPT_VERIFY_HOST},
+		{"no-verify", no_argument, NULL, OPT_NO_VERIFY},
+		{"cert-comp", required_argument, NULL, OPT_CERT_COMP},
+		{"sni", required_argument, NULL, OPT_SNI},
+		{"sni-dist", required_argument, NULL, OPT_SNI_DIST},
+		{"ocsp", no_argument, NULL, OPT_OCSP},
+		{"sigalgs", required_argument, NULL, OPT_SIGALGS},
+		{"max-frag", required_argument, NULL, OPT_MAX_FRAG},
+		{"record-limit", required_argument, NULL, OPT_RECORD_LIMIT},
+		{"mix", required_argument, NULL, OPT_MIX},
+		{"alpn", required_argument, NULL, OPT_ALPN},
+		{"grease", no_argument, NULL, OPT_GREASE},
+		{"padding", no_argument, NULL, OPT_PADDING},
+		{"profile", required_argument, NULL, OPT_PROFILE},
+		{"profiles", required_argument, NULL, OPT_PROFILES},
+		{"reject", required_argument, NULL, OPT_REJECT},
+		{"rekey", required_argument, NULL, OPT_REKEY},
+		{"psk", required_argument, NULL, OPT_PSK},
+		{"psk-mode", required_argument, NULL, OPT_PSK_MODE},
+		{"client-cert-random", no_argument, NULL,
+		 OPT_CLIENT_CERT_RANDOM},
+		{"sess-load", required_argument, NULL, OPT_SESS_LOAD},
+		{"sess-save", required_argument, NULL, OPT_SESS_SAVE},
 		{0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "hl:c:C:dqt:n:T:", long_opts, &o))
-		!= -1)
+	while ((c = getopt_long(argc, argv, "hl:c:C:dqt:n:T:V:K:F:",
+				long_opts, &o)) != -1)
 	{
 		switch (c) {
 		case 0:
@@ -787,12 +3840,498 @@ do_getopt(int argc, char *argv[]) noexcept
 		case 'F':
 			g_opt.keylogfile = optarg;
 			break;
+		case OPT_SWEEP:
+			g_opt.sweep = true;
+			break;
+		case OPT_LAT_TARGET:
+			g_opt.lat_target = atoi(optarg);
+			if (g_opt.lat_target <= 0) {
+				std::cerr << "ERROR: bad latency target"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_BURST:
+			g_opt.burst_period = atoi(optarg);
+			if (g_opt.burst_period <= 0) {
+				std::cerr << "ERROR: bad burst period"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_THINK:
+			if (!g_opt.think.parse(optarg)) {
+				std::cerr << "ERROR: bad think time"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_RESUME:
+			g_opt.resume = RESUME_ANY;
+			for (int m = RESUME_ID; m <= RESUME_PSK_KE; ++m)
+				if (!strcmp(optarg, resume_modes[m]))
+					g_opt.resume = m;
+			if (g_opt.resume == RESUME_ANY) {
+				std::cerr << "ERROR: unknown resumption mode"
+					<< std::endl;
+				return -EINVAL;
+			}
+			g_opt.use_tickets = true;
+			g_opt.adv_tickets = false;
+			g_opt.tls_vers = g_opt.resume >= RESUME_PSK_DHE_KE
+					 ? TLS1_3_VERSION : TLS1_2_VERSION;
+			break;
+		case OPT_RESUME_RATIO:
+			g_opt.resume_ratio = atoi(optarg);
+			if (g_opt.resume_ratio < 0 || g_opt.resume_ratio > 100)
+			{
+				std::cerr << "ERROR: resumption ratio must be"
+					     " between 0 and 100" << std::endl;
+				return -EINVAL;
+			}
+			g_opt.use_tickets = true;
+			g_opt.adv_tickets = false;
+			break;
+		case OPT_SESS_POOL:
+			g_opt.sess_pool_max = atol(optarg);
+			if (!g_opt.sess_pool_max) {
+				std::cerr << "ERROR: bad session pool size"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_TICKETS_WAIT:
+			g_opt.tickets_wait = atoi(optarg);
+			if (g_opt.tickets_wait < 0) {
+				std::cerr << "ERROR: bad number of tickets"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_TICKETS_TO:
+			g_opt.tickets_to = atoi(optarg);
+			if (g_opt.tickets_to <= 0) {
+				std::cerr << "ERROR: bad tickets waiting time"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_REQUEST:
+		{
+			std::ifstream f(optarg, std::ios::binary);
+			std::stringstream ss;
+			ss << f.rdbuf();
+			g_opt.request = ss.str();
+			if (!f || g_opt.request.empty()) {
+				std::cerr << "ERROR: can't read request from '"
+					<< optarg << "'" << std::endl;
+				return -EINVAL;
+			}
+			break;
+		}
+		case OPT_EARLY_DATA:
+			g_opt.early_data = true;
+			break;
+		case OPT_CLIENT_CERTS:
+			g_opt.client_certs = optarg;
+			break;
+		case OPT_CLIENT_CERT_RANDOM:
+			g_opt.client_cert_random = true;
+			break;
+		case OPT_PHA:
+			g_opt.pha = true;
+			break;
+		case OPT_PHA_TO:
+			g_opt.pha_to = atoi(optarg);
+			if (g_opt.pha_to <= 0) {
+				std::cerr << "ERROR: bad post-handshake"
+					     " authentication waiting time"
+					  << std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_VERIFY:
+			g_opt.verify = optarg;
+			break;
+		case OPT_VERIFY_HOST:
+			g_opt.verify_host = optarg;
+			break;
+		case OPT_NO_VERIFY:
+			g_opt.verify = NULL;
+			g_opt.verify_host = NULL;
+			break;
+		case OPT_SNI:
+			g_opt.sni_file = optarg;
+			break;
+		case OPT_OCSP:
+			g_opt.ocsp = true;
+			break;
+		case OPT_SIGALGS:
+			g_opt.sigalgs = optarg;
+			break;
+		case OPT_MAX_FRAG:
+			switch (atoi(optarg)) {
+			case 512:
+				g_opt.max_frag = TLSEXT_max_fragment_length_512;
+				break;
+			case 1024:
+				g_opt.max_frag = TLSEXT_max_fragment_length_1024;
+				break;
+			case 2048:
+				g_opt.max_frag = TLSEXT_max_fragment_length_2048;
+				break;
+			case 4096:
+				g_opt.max_frag = TLSEXT_max_fragment_length_4096;
+				break;
+			default:
+				std::cerr << "ERROR: bad max fragment length"
+					  << std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_RECORD_LIMIT:
+			g_opt.record_limit = atoi(optarg);
+			if (g_opt.record_limit < 64
+			    || g_opt.record_limit > 16385)
+			{
+				std::cerr << "ERROR: bad record size limit"
+					  << std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_SNI_DIST:
+			if (!strcmp(optarg, "uniform")) {
+				g_opt.sni_dist = SNI_UNIFORM;
+			}
+			else if (!strcmp(optarg, "seq")) {
+				g_opt.sni_dist = SNI_SEQ;
+			}
+			else if (!strncmp(optarg, "zipf", 4)
+				 && (!optarg[4] || optarg[4] == ':'))
+			{
+				g_opt.sni_dist = SNI_ZIPF;
+				g_opt.sni_zipf_s = optarg[4] ? atof(optarg + 5)
+							     : 1.0;
+				if (g_opt.sni_zipf_s <= 0) {
+					std::cerr << "ERROR: bad Zipf exponent"
+						  << std::endl;
+					return -EINVAL;
+				}
+			}
+			else {
+				std::cerr << "ERROR: unknown SNI distribution '"
+					  << optarg << "'" << std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_CERT_COMP:
+		{
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+			std::cerr << "ERROR: certificate compression requires"
+				     " OpenSSL 3.2" << std::endl;
+			return -EINVAL;
+#endif
+			std::stringstream ss(optarg);
+			std::string a;
+			while (std::getline(ss, a, ':'))
+				if (std::find(std::begin(cert_comp_algs),
+					      std::end(cert_comp_algs), a)
+				    == std::end(cert_comp_algs))
+				{
+					std::cerr << "ERROR: unknown certificate"
+						     " compression '" << a
+						  << "'" << std::endl;
+					return -EINVAL;
+				}
+			g_opt.cert_comp = optarg;
+			break;
+		}
+		case OPT_KEY_SHARE:
+			g_opt.key_share = optarg;
+#if OPENSSL_VERSION_NUMBER < 0x30500000L
+			if (strchr(optarg, ':')) {
+				std::cerr << "ERROR: OpenSSL before 3.5 sends"
+					     " only one key share" << std::endl;
+				return -EINVAL;
+			}
+#endif
+			break;
+		case OPT_SESS_LOAD:
+		case OPT_SESS_SAVE:
+			if (c == OPT_SESS_LOAD)
+				g_opt.sess_load = optarg;
+			else
+				g_opt.sess_save = optarg;
+			// Persistent sessions make sense only for the pool.
+			if (g_opt.resume_ratio < 0)
+				g_opt.resume_ratio = 100;
+			g_opt.use_tickets = true;
+			g_opt.adv_tickets = false;
+			break;
+		case OPT_SCENARIO:
+			g_opt.scenario = optarg;
+			break;
+		case OPT_MIX:
+			g_opt.mix = optarg;
+			break;
+		case OPT_ALPN:
+			g_opt.alpn = optarg;
+			break;
+		case OPT_GREASE:
+			g_opt.grease = true;
+			break;
+		case OPT_PADDING:
+			g_opt.padding = true;
+			break;
+		case OPT_PROFILE:
+			g_opt.profile = optarg;
+			break;
+		case OPT_PROFILES:
+			g_opt.profiles = optarg;
+			break;
+		case OPT_REJECT:
+			g_opt.reject = REJECT_NONE;
+			for (int m = REJECT_VERSION; m <= REJECT_TICKET; ++m)
+				if (!strcmp(optarg, reject_modes[m]))
+					g_opt.reject = m;
+			if (g_opt.reject == REJECT_NONE) {
+				std::cerr << "ERROR: unknown reject mode"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_HOLD:
+			if (!g_opt.hold.parse(optarg)) {
+				std::cerr << "ERROR: bad hold time"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_PSK:
+			g_opt.psk = optarg;
+			break;
+		case OPT_PSK_MODE:
+			if (!strcmp(optarg, "psk_dhe_ke")) {
+				g_opt.psk_ke = false;
+			}
+			else if (!strcmp(optarg, "psk_ke")) {
+				g_opt.psk_ke = true;
+			}
+			else {
+				std::cerr << "ERROR: unknown PSK mode"
+					  << std::endl;
+				return -EINVAL;
+			}
+			break;
+		case OPT_REKEY:
+			if (!g_opt.rekey.parse(optarg)) {
+				std::cerr << "ERROR: bad rekey interval"
+					<< std::endl;
+				return -EINVAL;
+			}
+			break;
 		case 'h':
 		default:
+			// Don't exit on bad options in scenario phases.
+			if (phase)
+				return -EINVAL;
 			usage();
 			return 1;
 		}
 	}
+	return 0;
+}
+
+/**
+ * Check that the given options don't conflict.
+ */
+static int
+check_opts() noexcept
+{
+	if (g_opt.resume != RESUME_ANY
+	    && (!g_opt.use_tickets
+		|| g_opt.tls_vers != (g_opt.resume >= RESUME_PSK_DHE_KE
+				      ? TLS1_3_VERSION : TLS1_2_VERSION)))
+	{
+		std::cerr << "ERROR: resumption mode '"
+			  << resume_modes[g_opt.resume] << "' conflicts with"
+			     " TLS version or tickets mode" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.burst_period
+	    && (g_opt.lat_target || g_opt.think.type != Dist::NONE
+		|| g_opt.hold.type != Dist::NONE
+		|| g_opt.rekey.type != Dist::NONE))
+	{
+		std::cerr << "ERROR: burst mode can't be used with latency"
+			     " target, think, hold or rekey times" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.sweep && !g_opt.timeout && g_opt.n_hs == ULONG_MAX) {
+		std::cerr << "ERROR: thread sweep requires either -T or -n to"
+			     " limit each step" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.verify_host && !g_opt.verify) {
+		std::cerr << "ERROR: host name check requires --verify"
+			  << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.pha && g_opt.tls_vers == TLS1_2_VERSION) {
+		std::cerr << "ERROR: post-handshake authentication requires"
+			     " TLS 1.3" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.curve || g_opt.key_share) {
+		// Hybrid post-quantum groups depend on the OpenSSL version and
+		// providers, so check them before the threads start.
+		SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+		bool ok = ctx && SSL_CTX_set1_groups_list(ctx,
+						groups_list(g_opt).c_str());
+		SSL_CTX_free(ctx);
+		ERR_clear_error();
+		if (!ok) {
+			std::cerr << "ERROR: groups '" << groups_list(g_opt)
+				  << "' aren't supported by "
+				  << OpenSSL_version(OPENSSL_VERSION)
+				  << std::endl;
+			return -EINVAL;
+		}
+	}
+	if (g_opt.sigalgs && strcmp(g_opt.sigalgs, "any")) {
+		SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+		bool ok = ctx && SSL_CTX_set1_sigalgs_list(ctx, g_opt.sigalgs);
+		SSL_CTX_free(ctx);
+		ERR_clear_error();
+		if (!ok) {
+			std::cerr << "ERROR: bad signature algorithms '"
+				  << g_opt.sigalgs << "'" << std::endl;
+			return -EINVAL;
+		}
+	}
+	if (g_opt.alpn) {
+		std::string wire;
+		if (!alpn_wire(g_opt.alpn, wire)) {
+			std::cerr << "ERROR: bad ALPN '" << g_opt.alpn << "'"
+				  << std::endl;
+			return -EINVAL;
+		}
+	}
+	// Check it for each mix class as well: with '-V any' the server
+	// may choose TLS 1.2 and ignore the PSK.
+	if (g_opt.psk && (g_opt.use_tickets
+			  || g_opt.tls_vers != TLS1_3_VERSION))
+	{
+		std::cerr << "ERROR: external PSK requires TLS 1.3 and can't be"
+			     " used with session resumption" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.cert_comp && strcmp(g_opt.cert_comp, "none")
+	    && (":" + std::string(g_opt.cert_comp) + ":").find(":none:")
+	       != std::string::npos)
+	{
+		std::cerr << "ERROR: certificate compression 'none' can't be"
+			     " combined with algorithms" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.psk_ke && !g_opt.psk) {
+		std::cerr << "ERROR: PSK mode requires --psk" << std::endl;
+		return -EINVAL;
+	}
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+	if (g_opt.reject == REJECT_GROUP && g_opt.tls_vers == TLS1_3_VERSION) {
+		std::cerr << "ERROR: rejection by group requires TLS 1.2 or"
+			     " OpenSSL 3.2" << std::endl;
+		return -EINVAL;
+	}
+#endif
+	if (g_opt.reject == REJECT_TICKET && !g_opt.use_tickets) {
+		std::cerr << "ERROR: invalid tickets require -K on"
+			  << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.mix && g_opt.profile) {
+		std::cerr << "ERROR: profiles can't be used with mix file,"
+			     " use --profile in the mix classes" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.key_share && g_opt.tls_vers == TLS1_2_VERSION) {
+		std::cerr << "ERROR: key shares require TLS 1.3" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.early_data
+	    && (!g_opt.use_tickets || g_opt.tls_vers == TLS1_2_VERSION))
+	{
+		std::cerr << "ERROR: early data requires TLS 1.3 session"
+			     " resumption" << std::endl;
+		return -EINVAL;
+	}
+	if (g_opt.sweep && g_opt.scenario) {
+		std::cerr << "ERROR: thread sweep can't be used with"
+			     " scenario" << std::endl;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int
+do_getopt(int argc, char *argv[]) noexcept
+{
+	int r;
+
+	g_opt.n_peers = DEFAULT_PEERS;
+	g_opt.n_threads = DEFAULT_THREADS;
+	g_opt.n_hs = ULONG_MAX; // infinite, in practice
+	g_opt.cipher = NULL;
+	g_opt.curve = NULL;
+	g_opt.key_share = NULL;
+	g_opt.cert_comp = NULL;
+	g_opt.sigalgs = NULL;
+	g_opt.max_frag = 0;
+	g_opt.record_limit = 0;
+	g_opt.alpn = NULL;
+	g_opt.mix = NULL;
+	g_opt.profile = NULL;
+	g_opt.profiles = NULL;
+	g_opt.client_certs = NULL;
+	g_opt.psk = NULL;
+	g_opt.verify = NULL;
+	g_opt.sni_file = NULL;
+	g_opt.sni_dist = SNI_UNIFORM;
+	g_opt.sni_zipf_s = 1.0;
+	g_opt.verify_host = NULL;
+	g_opt.client_cert_random = false;
+	g_opt.keylogfile = NULL;
+	g_opt.debug = false;
+	g_opt.sweep = false;
+	g_opt.early_data = false;
+	g_opt.pha = false;
+	g_opt.ocsp = false;
+	g_opt.grease = false;
+	g_opt.psk_ke = false;
+	g_opt.padding = false;
+	g_opt.timeout = 0;
+	g_opt.lat_target = 0;
+	g_opt.burst_period = 0;
+	g_opt.think.type = Dist::NONE;
+	g_opt.hold.type = Dist::NONE;
+	g_opt.rekey.type = Dist::NONE;
+	g_opt.scenario = NULL;
+	g_opt.tls_vers = TLS1_2_VERSION;
+	g_opt.use_tickets = false;
+	g_opt.adv_tickets = false;
+	g_opt.resume = RESUME_ANY;
+	g_opt.resume_ratio = -1;
+	g_opt.reject = REJECT_NONE;
+	g_opt.sess_pool_max = SESS_POOL_MAX;
+	g_opt.tickets_wait = 1;
+	g_opt.tickets_to = TICKETS_WAIT_MSEC;
+	g_opt.pha_to = RESPONSE_TO_MSEC;
+	g_opt.sess_load = NULL;
+	g_opt.sess_save = NULL;
+
+	if ((r = parse_opts(argc, argv, false)))
+		return r;
 	if (g_opt.keylogfile) {
 		// Don't drop previously saved keys
 		bio_keylog = BIO_new_file(g_opt.keylogfile, "a");
@@ -803,6 +4342,11 @@ do_getopt(int argc, char *argv[]) noexcept
 		}
 	}
 
+	if ((r = check_opts()))
+		return r;
+	if (g_opt.early_data && g_opt.request.empty())
+		g_opt.request = DEFAULT_REQUEST;
+
 	if (optind != argc && optind + 2 != argc) {
 		std::cerr << "\nERROR: either 0 or 2 arguments are allowed: "
 			  << "none for defaults or address and port."
@@ -839,24 +4383,123 @@ print_settings()
 		  << "TLS version: ";
 	if (g_opt.tls_vers == TLS1_2_VERSION)
 		std::cout << "1.2\n";
+	else if (g_opt.reject == REJECT_GROUP
+		 && g_opt.tls_vers != TLS1_3_VERSION)
+		std::cout << "1.2 (forced by rejection by group)\n";
 	else if (g_opt.tls_vers == TLS1_3_VERSION)
 		std::cout << "1.3\n";
 	else
 		std::cout << "Any of 1.2 or 1.3\n";
-	std::cout << "Cipher:      " << (g_opt.cipher ? : "default") << "\n"
-		  << "TLS tickets: " << (g_opt.use_tickets
-					 ? "on\n"
-					 : !g_opt.adv_tickets ? "off\n"
-							      : "advertise\n")
-		  << "Duration:    " << g_opt.timeout << "\n"
-		  << std::endl;
+	std::cout << "Cipher:      " << (g_opt.cipher ? : "default") << "\n";
+	if (g_opt.max_frag)
+		std::cout << "Max frag.:   " << (256 << g_opt.max_frag) << "\n";
+	if (g_opt.record_limit)
+		std::cout << "Rec. limit:  " << g_opt.record_limit << "\n";
+	if (g_opt.sigalgs)
+		std::cout << "Sigalgs:     " << g_opt.sigalgs << "\n";
+	if (g_opt.alpn)
+		std::cout << "ALPN:        " << g_opt.alpn << "\n";
+	if (g_opt.grease || g_opt.padding)
+		std::cout << "ClientHello: "
+			  << (g_opt.grease ? "GREASE " : "")
+			  << (g_opt.padding ? "padding" : "") << "\n";
+	if (g_opt.cert_comp)
+		std::cout << "Cert comp.:  " << g_opt.cert_comp << "\n";
+	if (g_opt.curve || g_opt.key_share)
+		std::cout << "Groups:      " << groups_list(g_opt)
+			  << (g_opt.key_share ? ", key shares: " : "")
+			  << (g_opt.key_share ? : "") << "\n";
+	std::cout << "TLS tickets: " << (g_opt.use_tickets
+				 ? "on\n"
+				 : !g_opt.adv_tickets ? "off\n"
+						      : "advertise\n")
+		  << "Duration:    " << g_opt.timeout << "\n";
+	if (g_opt.resume != RESUME_ANY)
+		std::cout << "Resumption:  " << resume_modes[g_opt.resume]
+			  << (g_opt.resume == RESUME_PSK_KE
+			      ? ", offer psk_dhe_ke and psk_ke" : "")
+			  << "\n";
+	if (g_opt.reject)
+		std::cout << "Reject:      " << reject_modes[g_opt.reject]
+			  << "\n";
+	if (g_opt.psk)
+		std::cout << "PSK:         " << g_psk.ent.size()
+			  << (g_opt.psk_ke ? ", offer psk_dhe_ke and psk_ke"
+					   : ", offer psk_dhe_ke") << "\n";
+	if (g_opt.use_tickets && g_opt.tls_vers != TLS1_2_VERSION)
+		std::cout << "Tickets:     wait for " << g_opt.tickets_wait
+			  << " TLS 1.3 tickets up to " << g_opt.tickets_to
+			  << "ms\n";
+	if (g_opt.resume_ratio >= 0)
+		std::cout << "Resume:      " << g_opt.resume_ratio << "% of"
+			  << " handshakes from the shared session pool\n";
+	if (g_opt.client_certs)
+		std::cout << "Client cert: " << g_client_certs.certs.size()
+			  << " from " << g_opt.client_certs
+			  << (g_opt.client_cert_random ? ", random order\n"
+						       : ", round-robin\n");
+	if (g_opt.pha)
+		std::cout << "Client auth: post-handshake, wait up to "
+			  << g_opt.pha_to << "ms\n";
+	for (auto &c : g_mix.cls) {
+		std::cout << (&c == &g_mix.cls[0] ? "Mix:         "
+						 : "             ")
+			  << c.weight * 100 / g_mix.total << "% " << c.name
+			  << ":";
+		for (auto &a : c.args)
+			std::cout << " " << a;
+		std::cout << "\n";
+	}
+	if (g_opt.sni_file) {
+		static const char *dists[] = { "uniform", "zipf", "seq" };
+		std::cout << "SNI:         " << g_sni.ent.size() << " names in "
+			  << g_sni.groups.size() << " groups from "
+			  << g_opt.sni_file << ", " << dists[g_opt.sni_dist];
+		if (g_opt.sni_dist == SNI_ZIPF)
+			std::cout << ":" << g_opt.sni_zipf_s;
+		std::cout << "\n";
+	}
+	if (g_opt.ocsp)
+		std::cout << "OCSP:        stapling requested\n";
+	if (g_opt.verify)
+		std::cout << "Verify:      " << g_opt.verify
+			  << (g_opt.verify_host ? ", host " : "")
+			  << (g_opt.verify_host ? : "") << "\n";
+	if (!g_opt.request.empty())
+		std::cout << "Request:     " << g_opt.request.size() << " bytes"
+			  << (g_opt.early_data ? ", as 0-RTT early data" : "")
+			  << "\n";
+	if (g_opt.sweep)
+		std::cout << "Threads:     sweep 1.." << g_opt.n_threads << "\n";
+	if (g_opt.burst_period)
+		std::cout << "Bursts:      " << g_opt.n_peers << " connections"
+			  << " per thread each " << g_opt.burst_period
+			  << "ms\n";
+	if (g_opt.think.type != Dist::NONE) {
+		std::cout << "Think time:  ";
+		g_opt.think.print();
+		std::cout << "\n";
+	}
+	if (g_opt.hold.type != Dist::NONE) {
+		std::cout << "Hold time:   ";
+		g_opt.hold.print();
+		std::cout << "\n";
+	}
+	if (g_opt.rekey.type != Dist::NONE) {
+		std::cout << "Rekey:       ";
+		g_opt.rekey.print();
+		std::cout << "\n";
+	}
+	if (g_opt.lat_target)
+		std::cout << "P99 target:  " << g_opt.lat_target << "ms, up to "
+			  << g_opt.n_peers << " connections per thread\n";
+	std::cout << std::endl;
 }
 
-std::atomic<bool> finish(false), start_stats(false);
-
 void
 sig_handler(int signum) noexcept
 {
+	interrupted = true;
 	finish = true;
 }
 
@@ -896,36 +4539,242 @@ statistics_update() noexcept
 	using namespace std::chrono;
 
 	auto tls_conns = stat.tls_connections.load();
+	auto tls_resumed = stat.tls_resumed.load();
 
 	auto now(steady_clock::now());
 	auto dt = duration_cast<milliseconds>(now - stat.stat_time).count();
+	auto cpu = cpu_usage_us();
+	auto dcpu = cpu - stat.cpu_prev;
 
 	stat.stat_time = now;
+	stat.cpu_prev = cpu;
 	stat.tls_connections -= tls_conns;
+	stat.tls_resumed -= tls_resumed;
 
 	int32_t curr_hs = (size_t)(1000 * tls_conns) / dt;
-	if (!g_opt.quiet)
+	if (!g_opt.quiet) {
 		std::cout << "TLS hs in progress " << stat.tls_handshakes
-			<< " [" << curr_hs << " h/s],"
+			<< " [" << curr_hs << " h/s";
+		if (g_opt.use_tickets)
+			std::cout << ", " << (size_t)(1000 * tls_resumed) / dt
+				  << " resumed";
+		std::cout << "],"
 			<< " TCP open conns " << stat.tcp_connections
 			<< " [" << stat.tcp_handshakes << " hs in progress],"
-			<< " Errors " << stat.error_count << std::endl;
+			<< " Errors " << stat.error_count;
+	}
+	if (!g_opt.quiet && (g_opt.hold.type != Dist::NONE
+			     || g_opt.rekey.type != Dist::NONE))
+		std::cout << ", TLS established " << stat.tls_established;
+
+	if (g_opt.lat_target) {
+		auto peers = g_adapt.peers.load();
+		auto p99 = LatencyHist::collect_percentile(99);
+		if (p99 || tls_conns)
+			adapt_concurrency(p99);
+		if (!g_opt.quiet)
+			std::cout << ", P99 " << p99 << "ms, peers " << peers
+				  << " -> " << g_adapt.peers << " per thread";
+		if (start_stats)
+			g_adapt.history.push_back({peers, curr_hs, p99});
+	}
+	if (!g_opt.quiet)
+		std::cout << std::endl;
 
 	if (!start_stats)
 		return;
 
-	stat.measures++;
-	if (stat.max_hs < curr_hs)
-		stat.max_hs = curr_hs;
-	if (curr_hs && (stat.min_hs > curr_hs || !stat.min_hs))
-		stat.min_hs = curr_hs;
-	stat.avg_hs = (stat.avg_hs * (stat.measures - 1) + curr_hs)
-			/ stat.measures;
-	if (stat.hs_history.size() == 3600)
-		std::cerr << "WARNING: benchmark is running for too long"
-			<< " last history won't be stored" << std::endl;
-	if (stat.hs_history.size() <= 3600)
-		stat.hs_history.push_back(curr_hs);
+	stat.measures++;
+	stat.cpu_us += dcpu;
+	stat.wall_us += dt * 1000;
+	stat.meas_hs += tls_conns;
+	if (stat.max_hs < curr_hs)
+		stat.max_hs = curr_hs;
+	if (curr_hs && (stat.min_hs > curr_hs || !stat.min_hs))
+		stat.min_hs = curr_hs;
+	stat.avg_hs = (stat.avg_hs * (stat.measures - 1) + curr_hs)
+			/ stat.measures;
+	if (stat.hs_history.size() == 3600)
+		std::cerr << "WARNING: benchmark is running for too long"
+			<< " last history won't be stored" << std::endl;
+	if (stat.hs_history.size() <= 3600)
+		stat.hs_history.push_back(curr_hs);
+}
+
+/**
+ * Print the adaptive concurrency history averaged over ADAPT_HIST_STEP
+ * measures to show drift of the server capacity, and the equilibrium
+ * concurrency over the second half of the test.
+ */
+void
+adapt_dump() noexcept
+{
+	auto &h = g_adapt.history;
+	if (h.empty())
+		return;
+
+	std::cout << " ADAPTIVE CONCURRENCY:\n"
+		  << "   SECONDS  PEERS/THR        H/S  P99 (ms)" << std::endl;
+	for (size_t i = 0; i < h.size(); i += ADAPT_HIST_STEP) {
+		size_t n = std::min(h.size() - i, (size_t)ADAPT_HIST_STEP);
+		uint64_t peers = 0, hs = 0, p99 = 0;
+		for (size_t j = i; j < i + n; ++j) {
+			peers += h[j].peers;
+			hs += h[j].hs;
+			p99 = std::max(p99, (uint64_t)h[j].p99);
+		}
+		std::cout << std::setw(10) << i + n
+			  << std::setw(11) << peers / n
+			  << std::setw(11) << hs / n
+			  << std::setw(10) << p99 << std::endl;
+	}
+
+	uint64_t peers = 0, hs = 0;
+	for (size_t i = h.size() / 2; i < h.size(); ++i) {
+		peers += h[i].peers;
+		hs += h[i].hs;
+	}
+	auto n = h.size() - h.size() / 2;
+	std::cout << " EQUILIBRIUM:     PEERS/THREAD " << peers / n
+		  << "; PEERS " << peers * g_opt.n_threads / n
+		  << "; H/S " << hs / n << std::endl;
+}
+
+/**
+ * Print drain time and latency distribution, measured from the burst release
+ * time, for each burst and for all the bursts together.
+ */
+void
+burst_dump() noexcept
+{
+	std::vector<unsigned long> all;
+	unsigned long max_drain = 0, acc_drain = 0;
+	size_t n = 0, missed = 0;
+
+	auto print_lat = [](std::vector<unsigned long> &lat) {
+		std::sort(lat.begin(), lat.end());
+		auto sz = lat.size();
+		std::cout << std::setw(8) << sz
+			  << std::setw(7) << lat[sz * 50 / 100]
+			  << std::setw(7) << lat[sz * 95 / 100]
+			  << std::setw(7) << lat[sz * 99 / 100]
+			  << std::setw(7) << lat.back();
+	};
+
+	std::cout << " BURSTS (ms):\n"
+		  << "     BURST   DRAIN   CONNS    P50    P95    P99    MAX"
+		  << std::endl;
+	for (size_t i = 0; i < g_burst.bursts.size(); ++i) {
+		auto &b = g_burst.bursts[i];
+		missed += b.missed;
+		if (b.lat.empty())
+			continue;
+		if (!g_opt.quiet) {
+			std::cout << std::setw(10) << i
+				  << std::setw(8) << b.drain;
+			print_lat(b.lat);
+			std::cout << std::endl;
+		}
+		all.insert(all.end(), b.lat.begin(), b.lat.end());
+		max_drain = std::max(max_drain, b.drain);
+		acc_drain += b.drain;
+		++n;
+	}
+	if (!n)
+		return;
+	std::cout << "       ALL" << std::setw(8) << acc_drain / n;
+	print_lat(all);
+	std::cout << "\n DRAIN (ms):      MAX " << max_drain
+		  << "; AVG " << acc_drain / n
+		  << "; BURSTS " << n << "; MISSED " << missed
+		  << std::endl;
+}
+
+/**
+ * Print average handshake messages sizes and TCP segments with data for
+ * the classes of group @g, if they were accounted.
+ */
+static void
+hs_class_sizes_dump(const std::string &g) noexcept
+{
+	bool header = false;
+	auto flags = std::cout.flags();
+	auto prec = std::cout.precision();
+
+	for (auto &cl : g_hs_class.cls) {
+		if (cl->group != g || !cl->sized)
+			continue;
+		if (!header) {
+			std::cout << "   " << std::setw(22) << ""
+				  << "   CH BYTES  SH BYTES  SERVER BYTES"
+				  << "  RECS OUT  RECS IN  SEGS OUT  SEGS IN"
+				  << std::endl;
+			header = true;
+		}
+		uint64_t n = cl->sized;
+		std::cout << "   " << std::left << std::setw(22) << cl->name
+			  << std::right << std::fixed << std::setprecision(1)
+			  << std::setw(11) << cl->ch_bytes / n
+			  << std::setw(10) << cl->sh_bytes / n
+			  << std::setw(14) << cl->srv_bytes / n
+			  << std::setw(10) << (double)cl->recs_out / n
+			  << std::setw(9) << (double)cl->recs_in / n
+			  << std::setw(10) << (double)cl->segs_out / n
+			  << std::setw(9) << (double)cl->segs_in / n
+			  << std::endl;
+	}
+	std::cout.flags(flags);
+	std::cout.precision(prec);
+}
+
+/**
+ * Print handshakes and latencies for each handshake class, grouped by
+ * the class groups in the order of their registration.
+ */
+void
+hs_class_dump() noexcept
+{
+	std::vector<std::string> groups;
+
+	for (auto &cl : g_hs_class.cls)
+		if (std::find(groups.begin(), groups.end(), cl->group)
+		    == groups.end())
+			groups.push_back(cl->group);
+
+	for (auto &g : groups) {
+		uint64_t total = 0;
+		for (auto &cl : g_hs_class.cls)
+			if (cl->group == g)
+				total += cl->hs;
+		if (!total)
+			continue;
+
+		std::cout << " " << std::left << std::setw(24) << g + ":"
+			  << std::right << " HANDSHAKES     H/S  SHARE"
+			  << "  LATENCY (ms): MIN  AVG  95P  MAX" << std::endl;
+		for (auto &cl : g_hs_class.cls) {
+			if (cl->group != g || !cl->hs)
+				continue;
+			auto &l = cl->lat.stat;
+			std::sort(l.begin(), l.end());
+			std::cout << "   " << std::left << std::setw(22)
+				  << cl->name << std::right
+				  << std::setw(11) << cl->hs
+				  << std::setw(8)
+				  << cl->hs / std::max(stat.measures, 1)
+				  << std::setw(6) << cl->hs * 100 / total
+				  << "%               ";
+			if (l.empty()) {
+				std::cout << "   -    -    -    -" << std::endl;
+				continue;
+			}
+			std::cout << std::setw(4) << l.front()
+				  << std::setw(5) << cl->lat.acc_lat / l.size()
+				  << std::setw(5) << l[l.size() * 95 / 100]
+				  << std::setw(5) << l.back() << std::endl;
+		}
+		hs_class_sizes_dump(g);
+	}
 }
 
 void
@@ -962,6 +4811,118 @@ statistics_dump() noexcept
 		// 95% latencies are smaller than this one.
 		<< "; 95P " << g_lat_stat.stat[lsz * 95 / 100]
 		<< "; MAX " << g_lat_stat.stat.back() << std::endl;
+
+	if (stat.wall_us && stat.meas_hs)
+		std::cout << " CPU (client):   "
+			<< " USAGE " << stat.cpu_us * 100 / stat.wall_us << "%"
+			<< "; PER HANDSHAKE " << stat.cpu_us / stat.meas_hs
+			<< " us" << std::endl;
+
+	hs_class_dump();
+	if (g_tickets.received || g_tickets.timeouts)
+		std::cout << " TLS 1.3 TICKETS: RECEIVED " << g_tickets.received
+			  << "; WAIT TIMEOUTS " << g_tickets.timeouts
+			  << "; CLOSED " << g_tickets.closed << std::endl;
+	if (g_early.sent)
+		std::cout << " EARLY DATA:      SENT " << g_early.sent
+			  << "; ACCEPTED " << g_early.accepted
+			  << "; REJECTED " << g_early.rejected << std::endl;
+	if (g_verify.verified || g_verify.failed)
+		std::cout << " SERVER VERIFY:   VERIFIED " << g_verify.verified
+			  << "; FAILED " << g_verify.failed << "; TIME "
+			  << g_verify.time_ns / 1000
+			     / (g_verify.verified + g_verify.failed)
+			  << " us per handshake" << std::endl;
+	if (g_ocsp.stapled)
+		std::cout << " OCSP STAPLES:    SIZE AVG "
+			  << g_ocsp.bytes / g_ocsp.stapled << "; MAX "
+			  << g_ocsp.max << " BYTES" << std::endl;
+	if (g_cert_comp.bytes)
+		std::cout << " CERTIFICATES:    " << g_cert_comp.bytes
+			  << " BYTES RECEIVED OF " << g_cert_comp.raw_bytes
+			  << " UNCOMPRESSED ("
+			  << g_cert_comp.bytes * 100 / g_cert_comp.raw_bytes
+			  << "%)" << std::endl;
+	if (g_pha.timeouts || g_pha.failed)
+		std::cout << " PHA ERRORS:      TIMEOUTS " << g_pha.timeouts
+			  << "; FAILED " << g_pha.failed << std::endl;
+	if (g_early.resp_errors)
+		std::cout << " RESPONSE ERRORS: " << g_early.resp_errors
+			  << std::endl;
+	if (g_rekey.timeouts || g_rekey.failed || g_rekey.refused)
+		std::cout << " REKEY ERRORS:    TIMEOUTS " << g_rekey.timeouts
+			  << "; FAILED " << g_rekey.failed
+			  << "; RENEGOTIATION REFUSED " << g_rekey.refused
+			  << std::endl;
+	if (g_opt.resume_ratio >= 0)
+		std::cout << " SESSION POOL:    SIZE " << g_sess_pool.sess.size()
+			  << "; PRELOADED LEFT "
+			  << g_sess_pool.off.size()
+			     - std::min(g_sess_pool.next.load(),
+					g_sess_pool.off.size())
+			  << "; EMPTY DRAWS " << g_sess_pool.empty_draws
+			  << std::endl;
+	if (g_opt.lat_target)
+		adapt_dump();
+	if (g_opt.burst_period)
+		burst_dump();
+}
+
+void
+statistics_reset() noexcept
+{
+	stat.tot_tls_handshakes = 0;
+	stat.tcp_handshakes = 0;
+	stat.tcp_connections = 0;
+	stat.tls_connections = 0;
+	stat.tls_handshakes = 0;
+	stat.error_count = 0;
+	stat.tls_established = 0;
+	stat.tls_resumed = 0;
+	stat.measures = 0;
+	stat.max_hs = 0;
+	stat.min_hs = 0;
+	stat.avg_hs = 0;
+	stat.hs_history.clear();
+	stat.cpu_us = 0;
+	stat.wall_us = 0;
+	stat.meas_hs = 0;
+
+	g_lat_stat.stat.clear();
+	g_lat_stat.acc_lat = 0;
+
+	g_adapt.limit = std::min(g_opt.n_peers, PEERS_SLOW_START);
+	g_adapt.peers = (int)g_adapt.limit;
+	g_adapt.history.clear();
+	LatencyHist::collect_percentile(99);
+
+	g_burst.bursts.clear();
+
+	g_hs_class.cls.clear();
+	// Keep the pooled sessions warm for the next runs.
+	g_sess_pool.empty_draws = 0;
+	g_tickets.received = 0;
+	g_tickets.timeouts = 0;
+	g_tickets.closed = 0;
+	g_early.sent = 0;
+	g_early.accepted = 0;
+	g_early.rejected = 0;
+	g_early.resp_errors = 0;
+	g_pha.timeouts = 0;
+	g_pha.failed = 0;
+	g_rekey.timeouts = 0;
+	g_rekey.failed = 0;
+	g_rekey.refused = 0;
+	g_cert_comp.bytes = 0;
+	g_ocsp.stapled = 0;
+	g_ocsp.bytes = 0;
+	g_ocsp.max = 0;
+	g_cert_comp.raw_bytes = 0;
+	g_verify.verified = 0;
+	g_verify.failed = 0;
+	g_verify.time_ns = 0;
+
+	start_stats = false;
 }
 
 bool
@@ -972,47 +4933,138 @@ end_of_work() noexcept
 	return finish || stat.tot_tls_handshakes >= g_opt.n_hs;
 }
 
+/**
+ * Park all the peers and release them at once at the same time as the other
+ * threads, then wait until all of them finish their handshakes, successfully
+ * or not, and park them again till the next burst.
+ */
+void
+burst_loop(int thr)
+{
+	using namespace std::chrono;
+
+	IO io(thr);
+	std::vector<SocketHandler *> all_peers;
+	std::vector<unsigned long> lat;
+	auto period = milliseconds(g_opt.burst_period);
+	auto release = g_burst.start;
+	size_t burst = 0;
+
+	for (int i = 0; i < g_opt.n_peers; ++i)
+		all_peers.push_back(new Peer(io, i));
+	lat.reserve(g_opt.n_peers);
+	start_stats = true;
+
+	while (!end_of_work()) {
+		// Sleep in short steps to not miss the end of the test.
+		auto now(steady_clock::now());
+		if (now < release) {
+			std::this_thread::sleep_until(std::min(release,
+						now + milliseconds(100)));
+			continue;
+		}
+
+		dbg << "release burst " << burst << std::endl;
+		for (auto p : all_peers)
+			p->next_state();
+
+		int done = 0;
+		lat.clear();
+		while (done < g_opt.n_peers && !finish) {
+			io.wait();
+			while (auto p = io.next_sk())
+				p->next_state();
+			while (auto p = io.next_timer())
+				p->next_state();
+
+			io.backlog();
+			auto dt = duration_cast<milliseconds>(steady_clock::now()
+							      - release);
+			while (io.next_backlog()) {
+				lat.push_back(dt.count());
+				++done;
+			}
+		}
+		if (done < g_opt.n_peers)
+			break;
+
+		auto drain = duration_cast<milliseconds>(steady_clock::now()
+							 - release);
+		g_burst.update(burst, drain.count(), lat);
+
+		// Skip the bursts which we missed while draining the last one.
+		for (++burst, release += period;
+		     release < steady_clock::now();
+		     ++burst, release += period)
+			g_burst.miss(burst);
+	}
+
+	for (auto p : all_peers)
+		delete p;
+}
+
 void
-io_loop()
+io_loop(int thr)
 {
 	int active_peers = 0;
-	int new_peers = std::min(g_opt.n_peers, PEERS_SLOW_START);
-	IO io;
-	std::list<SocketHandler *> all_peers;
+	int new_peers = std::min(peers_limit(), PEERS_SLOW_START);
+	IO io(thr);
+	std::list<SocketHandler *> all_peers, idle_peers;
 
 	while (!end_of_work()) {
+		// The limit changes in time in the adaptive concurrency mode.
+		int max_peers = peers_limit();
+
 		// We implement slow start of number of concurrent TCP
 		// connections, so active_peers and peers dynamically grow in
 		// this loop.
-		for ( ; active_peers < g_opt.n_peers && new_peers; --new_peers)
+		for ( ; active_peers < max_peers && new_peers; --new_peers)
 		{
-			Peer *p = new Peer(io, active_peers++);
-			all_peers.push_back(p);
+			SocketHandler *p;
+			if (!idle_peers.empty()) {
+				p = idle_peers.front();
+				idle_peers.pop_front();
+			} else {
+				p = new Peer(io, all_peers.size());
+				all_peers.push_back(p);
+			}
+			active_peers++;
 
 			if (p->next_state()
-			    && active_peers + new_peers < g_opt.n_peers)
+			    && active_peers + new_peers < max_peers)
 				++new_peers;
 		}
 
 		io.wait();
 		while (auto p = io.next_sk()) {
 			if (p->next_state()
-			    && active_peers + new_peers < g_opt.n_peers)
+			    && active_peers + new_peers < max_peers)
 				++new_peers;
 		}
 
+		// Close held connections and finish think times.
+		while (auto p = io.next_timer())
+			p->next_state();
+
 		// Process disconnected sockets from the backlog.
 		io.backlog();
 		while (!finish) {
 			auto p = io.next_backlog();
 			if (!p)
 				break;
+			// Don't reconnect the peer if the adaptive limit
+			// has decreased.
+			if (active_peers > max_peers) {
+				idle_peers.push_back(p);
+				--active_peers;
+				continue;
+			}
 			if (p->next_state()
-			    && active_peers + new_peers < g_opt.n_peers)
+			    && active_peers + new_peers < max_peers)
 				++new_peers;
 		}
 
-		if (active_peers == g_opt.n_peers && !start_stats) {
+		if (active_peers >= max_peers && !start_stats) {
 			start_stats = true;
 			std::cout << "( All peers are active, start to"
 				  << " gather statistics )"
@@ -1024,32 +5076,25 @@ io_loop()
 		delete p;
 }
 
-int
-main(int argc, char *argv[])
+void
+run_benchmark(int n_threads)
 {
 	using namespace std::chrono;
-	int r;
-
-	if ((r = do_getopt(argc, argv))) {
-		BIO_free_all(bio_keylog);
-		return r;
-	}
-	if (!g_opt.quiet)
-		print_settings();
-	update_limits();
-
-	signal(SIGTERM, sig_handler);
-	signal(SIGINT, sig_handler);
 
-	SSL_library_init();
-	SSL_load_error_strings();
+	statistics_reset();
+	finish = interrupted.load();
+	g_burst.start = steady_clock::now()
+			+ milliseconds(BURST_DELAY_MSEC);
 
-	std::vector<std::thread> thr(g_opt.n_threads);
-	for (auto i = 0; i < g_opt.n_threads; ++i) {
+	std::vector<std::thread> thr(n_threads);
+	for (auto i = 0; i < n_threads; ++i) {
 		dbg << "spawn thread " << (i + 1) << std::endl;
-		thr[i] = std::thread([]() {
+		thr[i] = std::thread([i]() {
 			try {
-				io_loop();
+				if (g_opt.burst_period)
+					burst_loop(i);
+				else
+					io_loop(i);
 			}
 			catch (Except &e) {
 				std::cerr << "ERROR: " << e.what() << std::endl;
@@ -1057,6 +5102,7 @@ main(int argc, char *argv[])
 			}
 
 			lat_stat.dump();
+			hs_class_dump_thread();
 		});
 	}
 
@@ -1074,8 +5120,584 @@ main(int argc, char *argv[])
 
 	for (auto &t : thr)
 		t.join();
+}
+
+/**
+ * Run the benchmark with 1, 2, 4, ... up to the requested number of threads
+ * and find the point where more client threads don't bring more handshakes
+ * from the server, i.e. the benchmark isn't client bound any more.
+ */
+void
+sweep_threads()
+{
+	struct Step {
+		int		threads;
+		int32_t		hs;
+		uint64_t	cpu_us;
+		uint64_t	wall_us;
+	};
+	std::vector<Step> steps;
+
+	for (int n = 1; !interrupted; n = std::min(n * 2, g_opt.n_threads)) {
+		std::cout << "\n>>> Thread sweep step: " << n << " thread(s)"
+			  << std::endl;
+		run_benchmark(n);
+		statistics_dump();
+		steps.push_back({n, stat.avg_hs, stat.cpu_us, stat.wall_us});
+		if (n == g_opt.n_threads)
+			break;
+	}
+
+	std::cout << "========================================\n"
+		  << " THREAD SWEEP:\n"
+		  << "   THREADS        H/S   CPU%   H/S/CORE" << std::endl;
+	for (auto &st : steps) {
+		// CPU usage in percents of one core, like top(1) shows.
+		auto cpu = st.wall_us ? st.cpu_us * 100 / st.wall_us : 0;
+		std::cout << std::setw(10) << st.threads
+			  << std::setw(11) << st.hs
+			  << std::setw(7) << cpu
+			  << std::setw(11) << (cpu ? st.hs * 100 / cpu : 0)
+			  << std::endl;
+	}
+
+	for (size_t i = 1; i < steps.size(); ++i) {
+		auto prev = steps[i - 1].hs, curr = steps[i].hs;
+		if (!prev || (int64_t)curr * 100
+			     >= (int64_t)prev * (100 + SWEEP_MIN_GAIN))
+			continue;
+		std::cout << " Server throughput saturates at "
+			  << steps[i - 1].threads << " thread(s): "
+			  << steps[i].threads << " threads change h/s by "
+			  << (int64_t)(curr - prev) * 100 / prev
+			  << "%" << std::endl;
+		return;
+	}
+	if (steps.size() > 1)
+		std::cout << " Server throughput still grows with client"
+			     " threads, try more threads" << std::endl;
+}
+
+/**
+ * Scenario phase: a name and options applied on top of the command line
+ * options.
+ */
+struct Phase {
+	std::string			name;
+	std::vector<std::string>	args;
+};
+
+static int
+load_scenario(const char *path, std::vector<Phase> &phases) noexcept
+{
+	std::ifstream f(path);
+	std::string line;
+
+	if (!f) {
+		std::cerr << "ERROR: cannot open scenario file '" << path
+			  << "'" << std::endl;
+		return -ENOENT;
+	}
+	while (std::getline(f, line)) {
+		auto c = line.find('#');
+		if (c != std::string::npos)
+			line.resize(c);
+
+		std::istringstream ss(line);
+		Phase ph;
+		if (!(ss >> ph.name))
+			continue;
+		for (std::string arg; ss >> arg; )
+			ph.args.push_back(arg);
+		phases.push_back(ph);
+	}
+	if (phases.empty()) {
+		std::cerr << "ERROR: no phases in scenario file '" << path
+			  << "'" << std::endl;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static bool
+opt_changed(const char *a, const char *b) noexcept
+{
+	return (a || b) && (!a || !b || strcmp(a, b));
+}
+
+/**
+ * Set g_opt to the base options with the phase options on top of them.
+ */
+static int
+apply_phase(Phase &ph, const decltype(g_opt) &base) noexcept
+{
+	std::vector<char *> argv;
+
+	g_opt = base;
+	argv.push_back((char *)ph.name.c_str());
+	for (auto &a : ph.args)
+		argv.push_back((char *)a.c_str());
+	argv.push_back(NULL);
+
+	optind = 0;
+	if (parse_opts(argv.size() - 1, argv.data(), true)
+	    || optind != (int)argv.size() - 1 || check_opts())
+		goto err;
+	if (g_opt.scenario != base.scenario || g_opt.sweep
+	    || g_opt.keylogfile != base.keylogfile)
+		goto err;
+	// The files are loaded once at start for all the phases.
+	if (opt_changed(g_opt.sess_load, base.sess_load)
+	    || opt_changed(g_opt.sess_save, base.sess_save)
+	    || opt_changed(g_opt.client_certs, base.client_certs)
+	    || opt_changed(g_opt.verify, base.verify)
+	    || opt_changed(g_opt.sni_file, base.sni_file)
+	    || g_opt.sni_dist != base.sni_dist
+	    || g_opt.sni_zipf_s != base.sni_zipf_s
+	    || opt_changed(g_opt.mix, base.mix)
+	    || opt_changed(g_opt.profile, base.profile)
+	    || opt_changed(g_opt.profiles, base.profiles)
+	    || opt_changed(g_opt.psk, base.psk))
+	{
+		std::cerr << "ERROR: session, client certificate, verify, SNI,"
+			     " mix, profile and PSK options can't be changed"
+			     " in a phase" << std::endl;
+		goto err;
+	}
+	if (!g_opt.timeout && g_opt.n_hs == ULONG_MAX) {
+		std::cerr << "ERROR: scenario phases must be limited by -T"
+			     " or -n" << std::endl;
+		goto err;
+	}
+	return 0;
+err:
+	std::cerr << "ERROR: bad options for scenario phase '" << ph.name
+		  << "'" << std::endl;
+	return -EINVAL;
+}
+
+/**
+ * Only TLS context options make sense for a mix class, the rest of the
+ * options are the same for all the connections.
+ */
+static bool
+mix_opt_allowed(const std::string &a) noexcept
+{
+	static const char *allowed[] = {
+		"--tls", "--key-share", "--sigalgs", "--cert-comp", "--ocsp",
+		"--max-frag", "--record-limit", "--alpn", "--grease",
+		"--padding", "--no-verify",
+	};
+
+	if (a.size() < 2 || a[0] != '-')
+		return true; // option argument
+	if (a[1] != '-')
+		return strchr("VcC", a[1]);
+	auto name = a.substr(0, a.find('='));
+	return std::find(std::begin(allowed), std::end(allowed), name)
+	       != std::end(allowed);
+}
+
+/**
+ * ClientHello profiles of common clients. OpenSSL doesn't allow to change
+ * the extensions order and to send GREASE values in the lists, so the
+ * profiles reproduce the rest: versions, groups and key shares, signature
+ * algorithms, ALPN, extensions, GREASE extensions and padding.
+ */
+static const struct {
+	const char	*name;
+	const char	*args;
+} builtin_profiles[] = {
+	{"chrome", "-V any -C X25519:P-256:P-384 --key-share X25519"
+		   " --sigalgs ecdsa_secp256r1_sha256:rsa_pss_rsae_sha256"
+		   ":rsa_pkcs1_sha256:ecdsa_secp384r1_sha384"
+		   ":rsa_pss_rsae_sha384:rsa_pkcs1_sha384:rsa_pss_rsae_sha512"
+		   ":rsa_pkcs1_sha512"
+		   " --alpn h2,http/1.1 --ocsp --grease --padding"
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+		   " --cert-comp brotli"
+#endif
+	},
+	{"firefox", "-V any -C X25519:P-256:P-384:P-521:ffdhe2048:ffdhe3072"
+#if OPENSSL_VERSION_NUMBER >= 0x30500000L
+		    " --key-share X25519:P-256"
+#else
+		    " --key-share X25519"
+#endif
+		    " --sigalgs ecdsa_secp256r1_sha256:ecdsa_secp384r1_sha384"
+		    ":ecdsa_secp521r1_sha512:rsa_pss_rsae_sha256"
+		    ":rsa_pss_rsae_sha384:rsa_pss_rsae_sha512:rsa_pkcs1_sha256"
+		    ":rsa_pkcs1_sha384:rsa_pkcs1_sha512:ECDSA+SHA1:RSA+SHA1"
+		    " --alpn h2,http/1.1 --ocsp --record-limit 16385"
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+		    " --cert-comp zlib:brotli:zstd"
+#endif
+	},
+	{"safari", "-V any -C X25519:P-256:P-384:P-521 --key-share X25519"
+		   " --sigalgs ecdsa_secp256r1_sha256:rsa_pss_rsae_sha256"
+		   ":rsa_pkcs1_sha256:ecdsa_secp384r1_sha384"
+		   ":rsa_pss_rsae_sha384:rsa_pkcs1_sha384:rsa_pss_rsae_sha512"
+		   ":rsa_pkcs1_sha512:RSA+SHA1"
+		   " --alpn h2,http/1.1 --ocsp --grease"
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+		   " --cert-comp zlib"
+#endif
+	},
+	// OpenSSL defaults, as sent by curl and most of the libraries.
+	{"curl", "-V any --alpn h2,http/1.1"},
+};
+
+/**
+ * Profiles from --profiles file, they override the built-in profiles.
+ */
+static std::map<std::string, std::vector<std::string>> g_profiles;
+
+/**
+ * Load the profiles file: each line is a profile name followed by the
+ * profile options.
+ */
+static int
+load_profiles(const char *path) noexcept
+{
+	std::ifstream f(path);
+	std::string line;
+
+	if (!f) {
+		std::cerr << "ERROR: cannot open profiles file '" << path << "'"
+			  << std::endl;
+		return -ENOENT;
+	}
+	while (std::getline(f, line)) {
+		auto c = line.find('#');
+		if (c != std::string::npos)
+			line.resize(c);
+
+		std::istringstream ss(line);
+		std::string name;
+		if (!(ss >> name))
+			continue;
+		auto &args = g_profiles[name];
+		args.clear();
+		for (std::string arg; ss >> arg; )
+			args.push_back(arg);
+	}
+	return 0;
+}
+
+static bool
+profile_find(const std::string &name, std::vector<std::string> &args)
+{
+	auto p = g_profiles.find(name);
+	if (p != g_profiles.end()) {
+		args = p->second;
+		return true;
+	}
+	for (auto &b : builtin_profiles)
+		if (name == b.name) {
+			std::istringstream ss(b.args);
+			args.clear();
+			for (std::string arg; ss >> arg; )
+				args.push_back(arg);
+			return true;
+		}
+	return false;
+}
+
+/**
+ * Replace '--profile <name>' in the mix class options with the profile
+ * options, so the rest of the class options can override them.
+ */
+static int
+profile_expand(MixClass &mc) noexcept
+{
+	std::vector<std::string> args;
+
+	for (size_t i = 0; i < mc.args.size(); ++i) {
+		std::string name;
+		if (mc.args[i] == "--profile" && i + 1 < mc.args.size())
+			name = mc.args[++i];
+		else if (!mc.args[i].compare(0, 10, "--profile="))
+			name = mc.args[i].substr(10);
+		else {
+			args.push_back(mc.args[i]);
+			continue;
+		}
+		std::vector<std::string> pa;
+		if (!profile_find(name, pa)) {
+			std::cerr << "ERROR: unknown profile '" << name << "'"
+				  << std::endl;
+			return -EINVAL;
+		}
+		args.insert(args.end(), pa.begin(), pa.end());
+	}
+	mc.args.swap(args);
+	return 0;
+}
+
+/**
+ * Parse the options of all the mix classes on top of the command line
+ * options.
+ */
+static int
+mix_parse() noexcept
+{
+	// Options point to the arguments, so parse them only when all the
+	// classes are in place.
+	auto base = g_opt;
+	for (auto &mc : g_mix.cls) {
+		if (profile_expand(mc))
+			return -EINVAL;
+
+		std::vector<char *> argv;
+		argv.push_back((char *)mc.name.c_str());
+		for (auto &a : mc.args) {
+			if (!mix_opt_allowed(a)) {
+				std::cerr << "ERROR: option '" << a << "' can't"
+					     " be used in mix class" << std::endl;
+				goto err;
+			}
+			argv.push_back((char *)a.c_str());
+		}
+		argv.push_back(NULL);
+
+		g_opt = base;
+		optind = 0;
+		if (parse_opts(argv.size() - 1, argv.data(), true)
+		    || optind != (int)argv.size() - 1 || check_opts())
+			goto err;
+		mc.opt = g_opt;
+		continue;
+	err:
+		std::cerr << "ERROR: bad options for mix class '" << mc.name
+			  << "'" << std::endl;
+		g_opt = base;
+		return -EINVAL;
+	}
+	g_opt = base;
+	return 0;
+}
+
+/**
+ * Build the connection mix from the list of profiles with optional weights,
+ * e.g. 'chrome:60,firefox:30,curl:10'.
+ */
+static int
+profile_mix(const char *list) noexcept
+{
+	std::istringstream ss(list);
+
+	for (std::string p; std::getline(ss, p, ','); ) {
+		MixClass mc;
+		auto c = p.find(':');
+		mc.name = p.substr(0, c);
+		mc.weight = c == std::string::npos ? 1 : atoi(p.c_str() + c + 1);
+		if (mc.name.empty() || !mc.weight) {
+			std::cerr << "ERROR: bad profile '" << p << "'"
+				  << std::endl;
+			return -EINVAL;
+		}
+		mc.args = {"--profile", mc.name};
+		g_mix.total += mc.weight;
+		g_mix.cls.push_back(mc);
+	}
+	if (g_mix.cls.empty()) {
+		std::cerr << "ERROR: no profiles in '" << list << "'"
+			  << std::endl;
+		return -EINVAL;
+	}
+	return mix_parse();
+}
+
+/**
+ * Load the mix classes: each line of the file is a class weight and name
+ * followed by the options for the class, applied on top of the command
+ * line options.
+ */
+static int
+load_mix(const char *path) noexcept
+{
+	std::ifstream f(path);
+	std::string line;
+
+	if (!f) {
+		std::cerr << "ERROR: cannot open mix file '" << path << "'"
+			  << std::endl;
+		return -ENOENT;
+	}
+	while (std::getline(f, line)) {
+		auto c = line.find('#');
+		if (c != std::string::npos)
+			line.resize(c);
+
+		std::istringstream ss(line);
+		MixClass mc;
+		if (!(ss >> mc.weight))
+			continue;
+		if (!mc.weight || !(ss >> mc.name)) {
+			std::cerr << "ERROR: bad mix class '" << line << "'"
+				  << std::endl;
+			return -EINVAL;
+		}
+		for (std::string arg; ss >> arg; )
+			mc.args.push_back(arg);
+		g_mix.total += mc.weight;
+		g_mix.cls.push_back(mc);
+	}
+	if (g_mix.cls.empty()) {
+		std::cerr << "ERROR: no classes in mix file '" << path << "'"
+			  << std::endl;
+		return -EINVAL;
+	}
+	return mix_parse();
+}
+
+/**
+ * Run all the scenario phases back to back and print the summary report.
+ * Phases with the same TLS settings reuse warm TLS contexts.
+ */
+void
+run_scenario(std::vector<Phase> &phases)
+{
+	struct Result {
+		std::string	name;
+		int32_t		measures;
+		uint64_t	hs;
+		int32_t		avg_hs;
+		unsigned long	lat_avg;
+		unsigned long	lat_95p;
+		int32_t		errors;
+	};
+	std::vector<Result> res;
+	auto base = g_opt;
+
+	for (auto &ph : phases) {
+		if (interrupted)
+			break;
+		// Options were checked on the scenario loading.
+		apply_phase(ph, base);
+
+		std::cout << "\n>>> Scenario phase: " << ph.name << std::endl;
+		if (!g_opt.quiet)
+			print_settings();
+		update_limits();
+		run_benchmark(g_opt.n_threads);
+		statistics_dump();
+
+		Result r = {ph.name, stat.measures, stat.tot_tls_handshakes,
+			    stat.avg_hs, 0, 0, stat.error_count};
+		if (auto lsz = g_lat_stat.stat.size()) {
+			// statistics_dump() has sorted the latencies.
+			r.lat_avg = g_lat_stat.acc_lat / lsz;
+			r.lat_95p = g_lat_stat.stat[lsz * 95 / 100];
+		}
+		res.push_back(r);
+	}
+	g_opt = base;
+
+	std::cout << "========================================\n"
+		  << " SCENARIO:\n"
+		  << "   PHASE            SECONDS HANDSHAKES    AVG H/S"
+		     " LAT AVG LAT 95P  ERRORS" << std::endl;
+	for (auto &r : res)
+		std::cout << "   " << std::left << std::setw(16) << r.name
+			  << std::right
+			  << std::setw(8) << r.measures
+			  << std::setw(11) << r.hs
+			  << std::setw(11) << r.avg_hs
+			  << std::setw(8) << r.lat_avg
+			  << std::setw(8) << r.lat_95p
+			  << std::setw(8) << r.errors << std::endl;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int r;
+
+	std::vector<Phase> phases;
+
+	if ((r = do_getopt(argc, argv))) {
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.sess_load && (r = sess_pool_load(g_opt.sess_load))) {
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.verify && (r = verify_store_load(g_opt.verify))) {
+		X509_STORE_free(g_verify.store);
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.profiles && (r = load_profiles(g_opt.profiles))) {
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.mix && (r = load_mix(g_opt.mix))) {
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.profile && (r = profile_mix(g_opt.profile))) {
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.sni_file && (r = sni_load(g_opt.sni_file))) {
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.client_certs && (r = client_certs_load(g_opt.client_certs))) {
+		client_certs_free_all();
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.psk && (r = psk_load(g_opt.psk))) {
+		psk_free_all();
+		client_certs_free_all();
+		BIO_free_all(bio_keylog);
+		return r;
+	}
+	if (g_opt.scenario) {
+		auto base = g_opt;
+		if ((r = load_scenario(g_opt.scenario, phases))) {
+			BIO_free_all(bio_keylog);
+			return r;
+		}
+		for (auto &ph : phases)
+			if ((r = apply_phase(ph, base))) {
+				BIO_free_all(bio_keylog);
+				return r;
+			}
+		g_opt = base;
+	} else {
+		if (!g_opt.quiet)
+			print_settings();
+		update_limits();
+	}
+
+	signal(SIGTERM, sig_handler);
+	signal(SIGINT, sig_handler);
+	// KeyUpdate and requests are written to the connections which the
+	// server may have already closed, the write error handles it.
+	signal(SIGPIPE, SIG_IGN);
 
-	statistics_dump();
+	SSL_library_init();
+	SSL_load_error_strings();
+
+	if (g_opt.scenario)
+		run_scenario(phases);
+	else if (g_opt.sweep)
+		sweep_threads();
+	else {
+		run_benchmark(g_opt.n_threads);
+		statistics_dump();
+	}
+	if (g_opt.sess_save)
+		sess_pool_save(g_opt.sess_save);
+	sess_pool_free_all();
+	client_certs_free_all();
+	psk_free_all();
+	tls_ctx_free_all();
+	X509_STORE_free(g_verify.store);
 	BIO_free_all(bio_keylog);
 
 	return 0;